@@ -24,17 +24,55 @@
 #include "CLI11.hpp"
 #include "json.hpp"
 
+#include <htslib/bgzf.h>
+#include <htslib/faidx.h>
 #include <htslib/sam.h>
+#include <htslib/thread_pool.h>
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <bit>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <filesystem>
+#include <format>
 #include <fstream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <optional>
 #include <print>
 #include <ranges>
+#include <span>
+#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <unordered_map>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__AVX2__) || defined(__SSSE3__)
+#include <immintrin.h>
+#endif
+
 // clang-format off
 static constexpr std::array<std::uint8_t, 256> encoding = {
   4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,  // 16
@@ -57,174 +95,3129 @@ static constexpr std::array<std::uint8_t, 256> encoding = {
 // clang-format on
 
 static constexpr auto n_nucs = 4u;
-static const auto dinucs = std::vector{
-  "CA",
-  "CC",
-  "CG",
-  "CT",
+
+/* A context of width K is the modified base and the K - 1 bases after it
+ * along its strand, indexed with 2 bits per base and the nearest base most
+ * significant. Tables for bases that read along the reverse of SEQ are
+ * indexed by the SEQ bases uncomplemented, so the same context on the
+ * other strand has index rc_index(width, i).
+ */
+static constexpr auto min_context_width = 2u;
+static constexpr auto max_context_width = 5u;
+static constexpr auto no_context = ~0u;
+
+[[nodiscard]] static constexpr auto
+n_contexts(const std::uint32_t width) -> std::uint32_t {
+  return 1u << (2 * (width - 1));
+}
+
+[[nodiscard]] static constexpr auto
+rc_index(const std::uint32_t width, const std::uint32_t idx) -> std::uint32_t {
+  return n_contexts(width) - 1 - idx;
+}
+
+// the context with this index, complemented if rev
+[[nodiscard]] static auto
+context_name(const char canonical, const std::uint32_t idx,
+             const std::uint32_t width, const bool rev) -> std::string {
+  static constexpr std::string_view fwd_bases = "ACGT";
+  static constexpr std::string_view rev_bases = "TGCA";
+  std::string name{canonical};
+  for (auto shift = 2 * (width - 1); shift > 0; shift -= 2) {
+    const auto b = (idx >> (shift - 2)) & 3u;
+    name += rev ? rev_bases[b] : fwd_bases[b];
+  }
+  return name;
+}
+
+// width from a name given by context_name, 0 if not a valid width
+[[nodiscard]] static auto
+context_width(const std::string_view name) -> std::uint32_t {
+  const auto width = static_cast<std::uint32_t>(std::size(name));
+  return width >= min_context_width && width <= max_context_width ? width
+                                                                    : 0;
+}
+
+// 4-bit codes from bam_get_seq to the 2-bit values used for contexts
+// clang-format off
+static constexpr std::array<std::uint8_t, 16> nt16_encoding = {
+  4, 0, 1, 4, 2, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4
+};
+// clang-format on
+
+/* Unpacks the 4-bit sequence into one encoded base per byte. The vector
+ * paths split each packed byte into its nibbles, map both through
+ * nt16_encoding with a byte shuffle and interleave them back into order.
+ */
+static auto
+unpack_bases(const std::uint8_t *seq, const std::int32_t qlen,
+             std::uint8_t *out) -> void {
+  // clang-format off
+  static constexpr auto pair_table = [] {
+    std::array<std::array<std::uint8_t, 2>, 256> t{};
+    for (auto i = 0u; i < 256; ++i)
+      t[i] = {nt16_encoding[i >> 4], nt16_encoding[i & 0xf]};
+    return t;
+  }();
+  // clang-format on
+  const auto n_packed = static_cast<std::size_t>(qlen + 1) / 2;
+  std::size_t i{};
+  // NOLINTBEGIN(*-pointer-arithmetic,*-reinterpret-cast)
+#if defined(__AVX2__)
+  const auto lut = _mm256_broadcastsi128_si256(
+    _mm_loadu_si128(reinterpret_cast<const __m128i *>(nt16_encoding.data())));
+  const auto low_mask = _mm256_set1_epi8(0x0f);
+  for (; i + 32 <= n_packed; i += 32) {
+    const auto v =
+      _mm256_loadu_si256(reinterpret_cast<const __m256i *>(seq + i));
+    const auto hi = _mm256_shuffle_epi8(
+      lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask));
+    const auto lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, low_mask));
+    // unpack works within 128-bit lanes so the halves are put back in order
+    const auto a = _mm256_unpacklo_epi8(hi, lo);
+    const auto b = _mm256_unpackhi_epi8(hi, lo);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + 2 * i),
+                        _mm256_permute2x128_si256(a, b, 0x20));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + 2 * i + 32),
+                        _mm256_permute2x128_si256(a, b, 0x31));
+  }
+#elif defined(__SSSE3__)
+  const auto lut =
+    _mm_loadu_si128(reinterpret_cast<const __m128i *>(nt16_encoding.data()));
+  const auto low_mask = _mm_set1_epi8(0x0f);
+  for (; i + 16 <= n_packed; i += 16) {
+    const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(seq + i));
+    const auto hi =
+      _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(v, 4), low_mask));
+    const auto lo = _mm_shuffle_epi8(lut, _mm_and_si128(v, low_mask));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 2 * i),
+                     _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 2 * i + 16),
+                     _mm_unpackhi_epi8(hi, lo));
+  }
+#endif
+  for (; i < n_packed; ++i)
+    std::memcpy(out + 2 * i, pair_table[seq[i]].data(), 2);
+  // NOLINTEND(*-pointer-arithmetic,*-reinterpret-cast)
+}
+
+/* One entry of the MM tag, e.g. "C+hm?,0,3,1;". The positions covered are
+ * query positions in SEQ order and the ML values for this entry start at
+ * ml_beg with n_codes values per position.
+ */
+struct basemod_entry {
+  char canonical{};
+  bool minus{};
+  std::uint32_t code_beg{};
+  std::uint32_t n_codes{};
+  std::uint32_t pos_beg{};
+  std::uint32_t n_pos{};
+  std::uint32_t ml_beg{};
+};
+
+// positions and ML values for one modification code within an MM entry
+struct basemod_track {
+  const std::int32_t *positions{};
+  const std::uint8_t *ml{};
+  std::uint32_t n_pos{};
+  std::uint32_t stride{};
+
+  [[nodiscard]] auto
+  size() const -> std::uint32_t {
+    return n_pos;
+  }
+  [[nodiscard]] auto
+  pos(const std::uint32_t i) const -> std::int32_t {
+    return positions[i];  // NOLINT(*-pointer-arithmetic)
+  }
+  [[nodiscard]] auto
+  qual(const std::uint32_t i) const -> std::uint8_t {
+    return ml[i * stride];  // NOLINT(*-pointer-arithmetic)
+  }
+};
+
+/* Parses the MM and ML tags in one pass over the MM string, locating the
+ * canonical bases directly in the packed sequence. This replaces
+ * bam_parse_basemod and bam_next_basemod, which do much more work per
+ * position than we need. Codes are stored as in htslib: the letter for
+ * single-letter codes and the negated ChEBI identifier otherwise.
+ */
+struct basemod_parser {
+  std::vector<std::uint8_t> bases;  // encoded, one per query position
+  std::vector<basemod_entry> entries;
+  std::vector<int> codes;
+  std::vector<std::int32_t> positions;
+  const std::uint8_t *ml{};
+  std::uint32_t ml_len{};
+
+  [[nodiscard]] auto
+  parse(const bam1_t *aln) -> bool {
+    entries.clear();
+    codes.clear();
+    positions.clear();
+    ml = nullptr;
+    ml_len = 0;
+
+    const auto mm_tag = get_aux(aln, "MM", "Mm");
+    const char *mm = mm_tag ? bam_aux2Z(mm_tag) : nullptr;
+    if (!mm)
+      return false;
+    if (const auto ml_tag = get_aux(aln, "ML", "Ml"); ml_tag) {
+      // NOLINTBEGIN(*-pointer-arithmetic)
+      if (ml_tag[0] != 'B' || ml_tag[1] != 'C')
+        return false;
+      ml_len = bam_auxB_len(ml_tag);
+      ml = ml_tag + 6;  // type, subtype and 4-byte length
+      // NOLINTEND(*-pointer-arithmetic)
+    }
+
+    const auto qlen = aln->core.l_qseq;
+    if (const auto mn_tag = bam_aux_get(aln, "MN");
+        mn_tag && bam_aux2i(mn_tag) != qlen)
+      return false;  // MM refers to a different SEQ, e.g. hard-clipped
+
+    // one extra byte as the last packed byte holds two bases
+    if (std::size(bases) < static_cast<std::size_t>(qlen) + 1)
+      bases.resize(qlen + 1);
+    unpack_bases(bam_get_seq(aln), qlen, bases.data());
+
+    const auto is_rev = bam_is_rev(aln);
+    const std::int32_t step = is_rev ? -1 : 1;
+
+    // NOLINTBEGIN(*-pointer-arithmetic)
+    const auto mm_end = mm + std::strlen(mm);
+    std::uint32_t ml_pos{};
+    while (mm != mm_end) {
+      basemod_entry e{};
+      e.canonical = *mm++;
+      if (mm == mm_end || (*mm != '+' && *mm != '-'))
+        return false;
+      e.minus = *mm++ == '-';
+
+      e.code_beg = std::size(codes);
+      if (mm != mm_end && std::isdigit(static_cast<unsigned char>(*mm))) {
+        int chebi{};
+        mm = std::from_chars(mm, mm_end, chebi).ptr;
+        codes.push_back(-chebi);
+      }
+      else
+        while (mm != mm_end && std::isalpha(static_cast<unsigned char>(*mm)))
+          codes.push_back(*mm++);
+      e.n_codes = std::size(codes) - e.code_beg;
+      if (e.n_codes == 0)
+        return false;
+      if (mm != mm_end && (*mm == '.' || *mm == '?'))
+        ++mm;
+
+      /* base to find in SEQ, walking from the 5' end of the original read.
+       * The MM letter is on the original read whatever the strand of the
+       * modification, and U is counted as T.
+       */
+      const auto letter = e.canonical == 'U' ? 'T' : e.canonical;
+      const auto base = encoding[static_cast<std::uint8_t>(letter)];
+      const auto any_base = e.canonical == 'N';
+      if (base == n_nucs && !any_base)
+        return false;
+      const auto target = is_rev ? n_nucs - 1 - base : base;
+
+      e.pos_beg = std::size(positions);
+      std::int32_t i = is_rev ? qlen - 1 : 0;
+      while (mm != mm_end && *mm == ',') {
+        std::uint32_t delta{};
+        const auto res = std::from_chars(mm + 1, mm_end, delta);
+        if (res.ec != std::errc{})
+          return false;
+        mm = res.ptr;
+        for (;; i += step) {
+          if (i < 0 || i >= qlen)
+            return false;
+          if ((any_base || bases[i] == target) && delta-- == 0)
+            break;
+        }
+        positions.push_back(i);
+        i += step;
+      }
+      if (mm != mm_end && *mm++ != ';')
+        return false;
+      e.n_pos = std::size(positions) - e.pos_beg;
+      e.ml_beg = ml_pos;
+      ml_pos += e.n_pos * e.n_codes;
+      entries.push_back(e);
+    }
+    // NOLINTEND(*-pointer-arithmetic)
+    return ml_pos <= ml_len;
+  }
+
+  [[nodiscard]] auto
+  track(const basemod_entry &e, const std::uint32_t j) const -> basemod_track {
+    // NOLINTNEXTLINE(*-pointer-arithmetic)
+    return {positions.data() + e.pos_beg, ml + e.ml_beg + j, e.n_pos,
+            e.n_codes};
+  }
+
+  [[nodiscard]] auto
+  find(const char canonical, const bool minus, const int code) const
+    -> std::optional<basemod_track> {
+    for (const auto &e : entries) {
+      if (e.canonical != canonical || e.minus != minus)
+        continue;
+      for (auto j = 0u; j < e.n_codes; ++j)
+        if (codes[e.code_beg + j] == code)
+          return track(e, j);
+    }
+    return std::nullopt;
+  }
+
+private:
+  [[nodiscard]] static auto
+  get_aux(const bam1_t *aln, const char *tag, const char *old_tag)
+    -> std::uint8_t * {
+    const auto t = bam_aux_get(aln, tag);
+    return t ? t : bam_aux_get(aln, old_tag);
+  }
+};
+
+struct genome_chunk {
+  std::int32_t tid{};
+  hts_pos_t beg{};
+  hts_pos_t end{};
+};
+
+/* Sorted and merged intervals used to select reads through the index and
+ * to restrict counting to positions inside the intervals.
+ */
+struct region_set {
+  std::vector<genome_chunk> intervals;
+
+  auto
+  add(const std::int32_t tid, const hts_pos_t beg, const hts_pos_t end)
+    -> void {
+    intervals.emplace_back(tid, beg, end);
+  }
+
+  auto
+  merge() -> void {
+    std::ranges::sort(intervals, [](const auto &a, const auto &b) {
+      return std::tie(a.tid, a.beg) < std::tie(b.tid, b.beg);
+    });
+    std::vector<genome_chunk> merged;
+    for (const auto &x : intervals)
+      if (!merged.empty() && merged.back().tid == x.tid &&
+          x.beg <= merged.back().end)
+        merged.back().end = std::max(merged.back().end, x.end);
+      else
+        merged.push_back(x);
+    intervals = std::move(merged);
+  }
+
+  [[nodiscard]] auto
+  contains(const std::int32_t tid, const hts_pos_t pos) const -> bool {
+    // first interval starting after pos; the one before may contain pos
+    const auto itr = std::ranges::upper_bound(
+      intervals, std::tie(tid, pos), std::less{},
+      [](const auto &x) { return std::tie(x.tid, x.beg); });
+    if (itr == std::cbegin(intervals))
+      return false;
+    const auto &x = *std::prev(itr);
+    return x.tid == tid && pos < x.end;
+  }
+
+  // in the form used by sam_itr_regarray, with names quoted
+  [[nodiscard]] auto
+  to_strings(const sam_hdr_t *hdr) const -> std::vector<std::string> {
+    std::vector<std::string> r;
+    for (const auto &[tid, beg, end] : intervals)
+      r.push_back(std::format("{{{}}}:{}-{}", sam_hdr_tid2name(hdr, tid),
+                              beg + 1, end));
+    return r;
+  }
+};
+
+[[nodiscard]] static auto
+read_regions(sam_hdr_t *hdr, const std::vector<std::string> &regions,
+             const std::string &bed_file) -> region_set {
+  region_set rs;
+  for (const auto &region : regions) {
+    int tid{};
+    hts_pos_t beg{};
+    hts_pos_t end{};
+    if (!sam_parse_region(hdr, region.data(), &tid, &beg, &end,
+                          HTS_PARSE_THOUSANDS_SEP))
+      throw std::runtime_error("failed to parse region: " + region);
+    rs.add(tid, beg, end);
+  }
+  if (!bed_file.empty()) {
+    std::ifstream in(bed_file);
+    if (!in)
+      throw std::runtime_error("failed to open file: " + bed_file);
+    std::string line;
+    while (std::getline(in, line)) {
+      if (line.empty() || line.starts_with('#') || line.starts_with("track") ||
+          line.starts_with("browser"))
+        continue;
+      std::istringstream iss(line);
+      std::string chrom;
+      hts_pos_t beg{};
+      hts_pos_t end{};
+      if (!(iss >> chrom >> beg >> end))
+        throw std::runtime_error("bad line in " + bed_file + ": " + line);
+      const auto tid = sam_hdr_name2tid(hdr, chrom.data());
+      if (tid >= 0)  // chroms missing from the header have no reads
+        rs.add(tid, beg, end);
+    }
+  }
+  rs.merge();
+  return rs;
+}
+
+// query position to reference position, -1 where the base is not aligned
+static auto
+get_ref_positions(const bam1_t *aln, std::vector<hts_pos_t> &ref_pos)
+  -> void {
+  const auto qlen = aln->core.l_qseq;
+  ref_pos.assign(qlen, -1);
+  if (aln->core.flag & BAM_FUNMAP)
+    return;
+  const auto cigar = bam_get_cigar(aln);
+  auto rpos = aln->core.pos;
+  std::int32_t qpos{};
+  for (auto i = 0u; i < aln->core.n_cigar; ++i) {
+    // NOLINTBEGIN(*-pointer-arithmetic)
+    const auto op = bam_cigar_op(cigar[i]);
+    const std::int32_t len = bam_cigar_oplen(cigar[i]);
+    // NOLINTEND(*-pointer-arithmetic)
+    const auto type = bam_cigar_type(op);  // 1: query, 2: reference
+    if ((type & 1) && qpos + len > qlen)
+      return;
+    if ((type & 1) && (type & 2))
+      for (auto j = 0; j < len; ++j)
+        ref_pos[qpos + j] = rpos + j;
+    if (type & 1)
+      qpos += len;
+    if (type & 2)
+      rpos += len;
+  }
+}
+
+// lookup by string_view without building a string
+struct string_hash {
+  using is_transparent = void;
+  [[nodiscard]] auto
+  operator()(const std::string_view s) const -> std::size_t {
+    return std::hash<std::string_view>{}(s);
+  }
+};
+
+/* Uncompressed FASTA mapped into memory. Offsets from its .fai, built if
+ * missing, locate any base with arithmetic alone, so lookups neither copy
+ * nor allocate.
+ */
+struct reference {
+  struct sequence {
+    const char *data{};
+    hts_pos_t len{};
+    hts_pos_t line_bases{};
+    hts_pos_t line_width{};
+
+    // n_nucs for anything but ACGT, in either case
+    [[nodiscard]] auto
+    base(const hts_pos_t pos) const -> std::uint8_t {
+      if (pos < 0 || pos >= len)
+        return n_nucs;
+      const auto c = data[pos / line_bases * line_width + pos % line_bases];
+      return encoding[static_cast<std::uint8_t>(c) & 0xdfu];
+    }
+  };
+
+  explicit reference(const std::string &filename) : filename{filename} {
+    const auto fd = ::open(filename.data(), O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error("failed to open file: " + filename);
+    struct stat st{};
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      size = static_cast<std::size_t>(st.st_size);
+      data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    ::close(fd);
+    if (!data || data == MAP_FAILED)
+      throw std::runtime_error("failed to map file: " + filename);
+    const auto bytes = static_cast<const unsigned char *>(data);
+    if (size >= 2 && bytes[0] == 0x1f && bytes[1] == 0x8b)
+      throw std::runtime_error("compressed reference not supported: " +
+                               filename);
+    load_index();
+  }
+
+  ~reference() {
+    if (data && data != MAP_FAILED)
+      munmap(data, size);
+  }
+
+  reference(const reference &) = delete;
+  auto
+  operator=(const reference &) -> reference & = delete;
+
+  [[nodiscard]] auto
+  find(const std::string_view name) const -> const sequence * {
+    const auto itr = seqs.find(name);
+    return itr != std::end(seqs) ? &itr->second : nullptr;
+  }
+
+private:
+  std::string filename;
+  void *data{};
+  std::size_t size{};
+  std::unordered_map<std::string, sequence, string_hash, std::equal_to<>>
+    seqs;
+
+  auto
+  load_index() -> void {
+    const auto fai_file = filename + ".fai";
+    if (!std::filesystem::exists(fai_file) && fai_build(filename.data()) < 0)
+      throw std::runtime_error("failed to index reference: " + filename);
+    std::ifstream in(fai_file);
+    if (!in)
+      throw std::runtime_error("failed to open file: " + fai_file);
+    std::string line;
+    while (std::getline(in, line)) {
+      std::istringstream fields(line);
+      std::string name;
+      sequence seq;
+      std::uint64_t offset{};
+      if (!(fields >> name >> seq.len >> offset >> seq.line_bases >>
+            seq.line_width) ||
+          seq.line_bases <= 0 || seq.line_width < seq.line_bases)
+        throw std::runtime_error("bad line in " + fai_file + ": " + line);
+      if (seq.len > 0) {
+        const auto last = offset + (seq.len - 1) / seq.line_bases *
+                                     seq.line_width +
+                          (seq.len - 1) % seq.line_bases;
+        if (last >= size)
+          throw std::runtime_error("index does not match: " + fai_file);
+      }
+      seq.data = static_cast<const char *>(data) + offset;
+      seqs.emplace(name, seq);
+    }
+  }
+};
+
+/* The reference sequence for each target of one input, in the order of
+ * its tids. Targets missing from the reference give no context.
+ */
+struct ref_targets {
+  std::vector<const reference::sequence *> seqs;
+
+  ref_targets() = default;
+  ref_targets(const reference &ref, const sam_hdr_t *hdr) {
+    const auto n_refs = sam_hdr_nref(hdr);
+    for (std::int32_t tid = 0; tid < n_refs; ++tid) {
+      const auto name = sam_hdr_tid2name(hdr, tid);
+      const auto seq = ref.find(name);
+      if (seq && seq->len != sam_hdr_tid2len(hdr, tid))
+        throw std::runtime_error(
+          std::format("reference length differs for {}", name));
+      seqs.push_back(seq);
+    }
+  }
+
+  [[nodiscard]] auto
+  base(const std::int32_t tid, const hts_pos_t pos) const -> std::uint8_t {
+    // NOLINTNEXTLINE(*-constant-array-index)
+    const auto seq = tid >= 0 && tid < std::ssize(seqs) ? seqs[tid] : nullptr;
+    return seq ? seq->base(pos) : n_nucs;
+  }
+
+  // context index of width K for the base at pos, as in read_context
+  template <std::uint32_t K>
+  [[nodiscard]] auto
+  context(const std::int32_t tid, const hts_pos_t pos, const bool rev) const
+    -> std::uint32_t {
+    std::uint32_t idx{};
+    for (hts_pos_t j = 1; j < K; ++j) {
+      const auto b = base(tid, rev ? pos - j : pos + j);
+      if (b == n_nucs)
+        return no_context;
+      idx = idx << 2 | b;
+    }
+    return idx;
+  }
+};
+
+/* Checks done on the record core so that reads we do not want are skipped
+ * before any basemod parsing. Secondary and supplementary alignments are
+ * excluded by default as they repeat the MM/ML of their primary. With a
+ * fraction below 1, reads are sampled by a seeded hash of their name, so
+ * the same reads are kept whatever the order or thread that sees them.
+ */
+struct read_filter {
+  static constexpr std::uint16_t default_exclude_flags =
+    BAM_FSECONDARY | BAM_FSUPPLEMENTARY;
+  std::uint16_t exclude_flags{default_exclude_flags};
+  std::uint32_t min_mapq{};
+  std::int32_t min_read_length{};
+  double fraction{1.0};
+  std::uint64_t seed{};
+
+  [[nodiscard]] auto
+  operator==(const read_filter &) const -> bool = default;
+
+  [[nodiscard]] auto
+  operator()(const bam1_t *aln) const -> bool {
+    const auto &c = aln->core;
+    return !(c.flag & exclude_flags) && c.qual >= min_mapq &&
+           c.l_qseq >= min_read_length && (fraction >= 1.0 || sampled(aln));
+  }
+
+  // FNV-1a over the name, then the splitmix64 finalizer to mix the bits
+  [[nodiscard]] auto
+  sampled(const bam1_t *aln) const -> bool {
+    auto h = seed ^ 0xcbf29ce484222325ull;
+    for (auto p = bam_get_qname(aln); *p; ++p)  // NOLINT(*-pointer-arithmetic)
+      h = (h ^ static_cast<std::uint8_t>(*p)) * 0x100000001b3ull;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+    h ^= h >> 31;
+    return static_cast<double>(h) < fraction * 0x1p64;
+  }
+};
+
+/* Time spent in each stage, summed over the threads doing it. Threads
+ * keep their own and add them to run_metrics once per batch.
+ */
+struct stage_times {
+  using clock = std::chrono::steady_clock;
+  using time_point = clock::time_point;
+  enum stage : std::uint8_t { open, read, parse, accumulate, write, format };
+  static constexpr auto n_stages = 6u;
+  static constexpr std::array<std::string_view, n_stages> names{
+    "open_header", "read_decompress", "basemod_parse",
+    "accumulate",  "passthrough_write", "format"};
+
+  std::array<clock::duration, n_stages> times{};
+
+  // adds the time since t to stage s and restarts t
+  auto
+  lap(const stage s, time_point &t) -> void {
+    const auto now = clock::now();
+    times[s] += now - t;  // NOLINT(*-constant-array-index)
+    t = now;
+  }
+};
+
+/* Counters shared by all threads for --progress and for the sampling
+ * summary. Bytes are offsets into compressed inputs, chunks are only
+ * counted with --by-region, and the ETA comes from whichever of the two
+ * has a known total. Stage times per read are only taken if timed.
+ */
+struct run_metrics {
+  bool timed{true};
+  std::atomic_uint64_t n_reads{};
+  std::atomic_uint64_t n_bases{};
+  std::atomic_uint64_t n_calls{};
+  std::atomic_uint64_t n_bytes{};
+  std::atomic_uint64_t n_chunks{};
+  std::atomic_uint64_t total_bytes{};
+  std::atomic_uint64_t total_chunks{};
+  stage_times::time_point start{stage_times::clock::now()};
+
+  auto
+  add(const std::uint64_t reads, const std::uint64_t bases,
+      const std::uint64_t calls, const stage_times &st) -> void {
+    n_reads += reads;
+    n_bases += bases;
+    n_calls += calls;
+    add(st);
+  }
+
+  auto
+  add(const stage_times &st) -> void {
+    std::lock_guard lock{mtx};
+    for (auto i = 0u; i < stage_times::n_stages; ++i)
+      times.times[i] += st.times[i];  // NOLINT(*-constant-array-index)
+  }
+
+  // one line per call, with rates averaged since the start
+  auto
+  report(std::ostream &out) const -> void {
+    using std::chrono::duration;
+    const auto secs =
+      duration<double>(stage_times::clock::now() - start).count();
+    const auto rate = [secs](const std::uint64_t n) {
+      return secs > 0.0 ? static_cast<double>(n) / secs : 0.0;
+    };
+    const auto ratio = [](const std::uint64_t a, const std::uint64_t b) {
+      return static_cast<double>(a) / static_cast<double>(b);
+    };
+    const auto fraction = total_chunks > 0 ? ratio(n_chunks, total_chunks)
+                          : total_bytes > 0 ? ratio(n_bytes, total_bytes)
+                                            : 0.0;
+    constexpr auto mb = 1024.0 * 1024.0;
+    auto line = std::format(
+      "[{:.0f}s] {} reads, {:.0f} reads/s, {:.3g} bases/s, {:.3g} mod "
+      "calls/s, {:.1f} MB read",
+      secs, n_reads.load(), rate(n_reads), rate(n_bases), rate(n_calls),
+      n_bytes / mb);
+    if (total_bytes > 0)
+      line += std::format(" of {:.1f} MB", total_bytes / mb);
+    if (total_chunks > 0)
+      line += std::format(", {}/{} chunks", n_chunks.load(),
+                          total_chunks.load());
+    if (fraction > 0.0 && fraction < 1.0)
+      line += std::format(", ETA {:.0f}s", secs * (1.0 - fraction) / fraction);
+    std::println(out, "{}", line);
+  }
+
+  // reports every interval until stop is requested
+  auto
+  report_every(const std::stop_token stop,
+               const std::chrono::seconds interval) const -> void {
+    std::mutex m;
+    std::condition_variable_any cv;
+    std::unique_lock lock{m};
+    while (!cv.wait_for(lock, stop, interval, [] { return false; }) &&
+           !stop.stop_requested())
+      report(std::cerr);
+  }
+
+  [[nodiscard]] auto
+  to_json() const -> nlohmann::json {
+    using std::chrono::duration;
+    const auto secs =
+      duration<double>(stage_times::clock::now() - start).count();
+    auto stages = nlohmann::json::object();
+    std::lock_guard lock{mtx};
+    for (auto i = 0u; i < stage_times::n_stages; ++i)
+      // NOLINTNEXTLINE(*-constant-array-index)
+      stages[stage_times::names[i]] = duration<double>(times.times[i]).count();
+    return {{"wall_seconds", secs},     {"reads", n_reads.load()},
+            {"bases", n_bases.load()},  {"mod_calls", n_calls.load()},
+            {"bytes_read", n_bytes.load()}, {"stage_seconds", stages}};
+  }
+
+private:
+  mutable std::mutex mtx;
+  stage_times times;
+};
+
+/* A modification as named in the MM tag: canonical base, strand and code,
+ * with ChEBI codes stored negated as in htslib.
+ */
+struct mod_key {
+  char canonical{};
+  bool minus{};
+  int code{};
+
+  auto
+  operator<=>(const mod_key &) const = default;
+
+  [[nodiscard]] auto
+  to_string() const -> std::string {
+    const auto strand = minus ? '-' : '+';
+    if (code < 0)
+      return std::format("{}{}{}", canonical, strand, -code);
+    return std::format("{}{}{}", canonical, strand, static_cast<char>(code));
+  }
+
+  [[nodiscard]] static auto
+  from_string(const std::string &s) -> mod_key {
+    if (std::size(s) < 3 || (s[1] != '+' && s[1] != '-'))
+      throw std::runtime_error("bad modification name: " + s);
+    const auto is_chebi = std::isdigit(static_cast<unsigned char>(s[2]));
+    return {s[0], s[1] == '-', is_chebi ? -std::stoi(s.substr(2)) : s[2]};
+  }
 };
-static const auto dinucs_rev = std::vector{
-  "CT",
-  "CG",
-  "CC",
-  "CA",
+
+/* A C+h and/or C+m call, kept for --pileup and --per-read. pos is the
+ * reference position, or -1 if not aligned. A qual of -1 means the read
+ * has no call for that code. cpg is set if the context along the strand
+ * of the C starts with G.
+ */
+struct site_call {
+  std::int32_t tid{};
+  hts_pos_t pos{};
+  std::int16_t h_qual{-1};
+  std::int16_t m_qual{-1};
+  bool rev{};
+  bool cpg{};
+
+  // midpoint of the ML bin, or 0 with no call
+  [[nodiscard]] static auto
+  to_prob(const std::int16_t qual) -> double {
+    return qual < 0 ? 0.0 : (qual + 0.5) / 256;
+  }
+
+  [[nodiscard]] auto
+  h_prob() const -> double {
+    return to_prob(h_qual);
+  }
+
+  [[nodiscard]] auto
+  m_prob() const -> double {
+    return to_prob(m_qual);
+  }
 };
 
 struct mod_prob_stats {
-  static constexpr auto max_mods = 10;
   static constexpr auto n_values = 256;
+
+  /* One row of n_values counts for each context, kept in one heap block
+   * so that rows for wide contexts are contiguous.
+   */
+  struct table_t {
+    std::vector<std::uint64_t> counts;
+
+    explicit table_t(const std::uint32_t n_contexts) :
+      counts(std::size_t{n_contexts} * n_values) {}
+
+    [[nodiscard]] auto
+    n_contexts() const -> std::uint32_t {
+      return static_cast<std::uint32_t>(std::size(counts) / n_values);
+    }
+
+    [[nodiscard]] auto
+    operator[](const std::uint32_t ctx) -> std::span<std::uint64_t, n_values> {
+      return std::span<std::uint64_t, n_values>{
+        counts.data() + std::size_t{ctx} * n_values, n_values};
+    }
+
+    [[nodiscard]] auto
+    operator[](const std::uint32_t ctx) const
+      -> std::span<const std::uint64_t, n_values> {
+      return std::span<const std::uint64_t, n_values>{
+        counts.data() + std::size_t{ctx} * n_values, n_values};
+    }
+
+    auto
+    operator+=(const table_t &rhs) -> table_t & {
+      std::ranges::transform(counts, rhs.counts, std::begin(counts),
+                             std::plus{});
+      return *this;
+    }
+  };
+
+  // ML values of the C+h and C+m calls counted, over all contexts
+  struct call_quals {
+    std::array<std::uint64_t, n_values> h{};
+    std::array<std::uint64_t, n_values> m{};
+  };
+
+  // histograms for any modification other than C+h and C+m
+  struct mod_hist {
+    mod_key key;
+    table_t fwd;
+    table_t rev;
+  };
+
   // scratch
-  std::array<hts_base_mod, max_mods> mods{};
-  std::unique_ptr<hts_base_mod_state, void (*)(hts_base_mod_state *)> m;
+  basemod_parser parser;
+  std::vector<hts_pos_t> ref_pos;
+
+  std::uint32_t width{min_context_width};
+  table_t methyl_fwd{n_contexts(width)};
+  table_t methyl_rev{n_contexts(width)};
+  table_t hydroxy_fwd{n_contexts(width)};
+  table_t hydroxy_rev{n_contexts(width)};
 
-  std::array<std::array<std::uint64_t, n_values>, n_nucs> methyl_fwd{};
-  std::array<std::array<std::uint64_t, n_values>, n_nucs> methyl_rev{};
-  std::array<std::array<std::uint64_t, n_values>, n_nucs> hydroxy_fwd{};
-  std::array<std::array<std::uint64_t, n_values>, n_nucs> hydroxy_rev{};
+  // registry of other modifications, in the order first seen
+  std::vector<mod_hist> other_mods;
 
-  mod_prob_stats() : m{hts_base_mod_state_alloc(), &hts_base_mod_state_free} {};
+  mod_prob_stats() = default;
+  explicit mod_prob_stats(const std::uint32_t width) : width{width} {}
   mod_prob_stats(const mod_prob_stats &rhs) = default;
+  mod_prob_stats(mod_prob_stats &&rhs) = default;
 
+  auto
+  operator+=(const mod_prob_stats &rhs) -> mod_prob_stats & {
+    if (rhs.width != width)
+      throw std::runtime_error(
+        std::format("context widths differ: {} and {}", width, rhs.width));
+    methyl_fwd += rhs.methyl_fwd;
+    methyl_rev += rhs.methyl_rev;
+    hydroxy_fwd += rhs.hydroxy_fwd;
+    hydroxy_rev += rhs.hydroxy_rev;
+    for (const auto &x : rhs.other_mods) {
+      auto &hist = get_hist(x.key);
+      hist.fwd += x.fwd;
+      hist.rev += x.rev;
+    }
+    return *this;
+  }
+
+  [[nodiscard]] auto
+  get_hist(const mod_key &key) -> mod_hist & {
+    const auto itr = std::ranges::find(other_mods, key, &mod_hist::key);
+    if (itr != std::end(other_mods))
+      return *itr;
+    const auto n = n_contexts(width);
+    return other_mods.emplace_back(key, table_t{n}, table_t{n});
+  }
+
+  /* Returns the number of modification calls in the read, or 0 if its
+   * tags could not be parsed. With ref, the context comes from the
+   * reference base next to the aligned position, so bases not aligned to
+   * the reference are skipped. Adds the time taken to times if given.
+   * C+h and C+m calls are appended to sites and the ML values of those
+   * counted are added to quals if given.
+   */
   [[nodiscard]] auto
-  operator()(const bam1_t *aln) {
-    static constexpr auto h_idx = 0;
-    static constexpr auto m_idx = 1;
+  operator()(const bam1_t *aln, const region_set *regions = nullptr,
+             const ref_targets *ref = nullptr, stage_times *times = nullptr,
+             std::vector<site_call> *sites = nullptr,
+             call_quals *quals = nullptr) -> std::uint32_t {
+    auto t = times ? stage_times::clock::now() : stage_times::time_point{};
+    const auto parsed = parser.parse(aln);
+    if (times)
+      times->lap(stage_times::parse, t);
+    if (!parsed)
+      return 0;
+    count_width(aln, regions, ref, sites, quals);
+    if (times)
+      times->lap(stage_times::accumulate, t);
+    return parser.ml_len;
+  }
+
+private:
+  // the width is chosen once per read so the context loops are unrolled
+  template <std::uint32_t K = min_context_width>
+  auto
+  count_width(const bam1_t *aln, const region_set *regions,
+              const ref_targets *ref, std::vector<site_call> *sites,
+              call_quals *quals) -> void {
+    if constexpr (K < max_context_width)
+      if (width != K) {
+        count_width<K + 1>(aln, regions, ref, sites, quals);
+        return;
+      }
+    count<K>(aln, regions, ref, sites, quals);
+  }
+
+  template <std::uint32_t K>
+  auto
+  count(const bam1_t *aln, const region_set *regions, const ref_targets *ref,
+        std::vector<site_call> *sites, call_quals *quals) -> void {
+    const auto tid = aln->core.tid;
     const auto qlen = aln->core.l_qseq;
-    const auto seq = bam_get_seq(aln);
-    const auto d = mods.data();
+    if (regions || ref || sites)
+      get_ref_positions(aln, ref_pos);
+    const auto in_regions = [&](const auto pos) {
+      return !regions || regions->contains(tid, ref_pos[pos]);
+    };
+    const auto context = [&](const auto pos,
+                             const bool seq_rev) -> std::uint32_t {
+      if (!ref)
+        return read_context<K>(pos, qlen, seq_rev);
+      const auto ref_at = ref_pos[pos];
+      return ref_at < 0 ? no_context
+                        : ref->template context<K>(tid, ref_at, seq_rev);
+    };
+
+    const auto h = parser.find('C', false, 'h');
+    const auto m = parser.find('C', false, 'm');
+    if (h || m)
+      count_hydroxy_methyl(aln, h.value_or(basemod_track{}),
+                           m.value_or(basemod_track{}), in_regions, context,
+                           sites, quals);
+    if (std::size(parser.codes) > std::size_t{h.has_value()} + m.has_value())
+      count_other_mods(aln, in_regions, context);
+  }
+
+  auto
+  add_site(std::vector<site_call> &sites, const bam1_t *aln,
+           const std::int32_t pos, const bool rev, const std::uint32_t ctx,
+           const std::int16_t h_qual, const std::int16_t m_qual) const
+    -> void {
+    // the nearest base is G, or C uncomplemented on the reverse of SEQ
+    const auto next = ctx >> (2 * (width - 2));
+    const auto cpg =
+      ctx != no_context && next == (rev ? encoding['C'] : encoding['G']);
+    sites.emplace_back(aln->core.tid, ref_pos[pos], h_qual, m_qual, rev, cpg);
+  }
+
+  // context of width K from the read along the strand of the modified base
+  template <std::uint32_t K>
+  [[nodiscard]] auto
+  read_context(const std::int32_t pos, const std::int32_t qlen,
+               const bool seq_rev) const -> std::uint32_t {
+    constexpr auto n_after = static_cast<std::int32_t>(K - 1);
+    if (seq_rev ? pos < n_after : pos + n_after >= qlen)
+      return no_context;
+    std::uint32_t idx{};
+    for (std::int32_t j = 1; j <= n_after; ++j) {
+      // NOLINTNEXTLINE(*-constant-array-index)
+      const auto b = parser.bases[seq_rev ? pos - j : pos + j];
+      if (b == n_nucs)
+        return no_context;
+      idx = idx << 2 | b;
+    }
+    return idx;
+  }
+
+  /* C+h and C+m calls, joined at each C called in both. Either track may
+   * be empty, and a C called in only one of them counts for that one.
+   */
+  auto
+  count_hydroxy_methyl(const bam1_t *aln, const basemod_track &h,
+                       const basemod_track &m, const auto &in_regions,
+                       const auto &context, std::vector<site_call> *sites,
+                       call_quals *quals) -> void {
     const auto is_rev = bam_is_rev(aln);
 
-    bam_parse_basemod(aln, m.get());
-    // ADS: or bam_parse_basemod2(aln, m.get(), HTS_MOD_REPORT_UNCHECKED)
+    // both tracks list positions in the order of the original read
+    const auto before = [is_rev](const auto a, const auto b) {
+      return is_rev ? a > b : a < b;
+    };
 
-    int pos{};
-    int n{};
-    while ((n = bam_next_basemod(aln, m.get(), d, max_mods, &pos)) > 0) {
-      if (n < m_idx)
+    std::uint32_t i{};
+    std::uint32_t j{};
+    while (i < h.size() || j < m.size()) {
+      const auto in_h = i < h.size();
+      const auto in_m = j < m.size();
+      const auto pos = !in_m || (in_h && before(h.pos(i), m.pos(j)))
+                         ? h.pos(i)
+                         : m.pos(j);
+      const std::int16_t h_qual = in_h && h.pos(i) == pos ? h.qual(i++) : -1;
+      const std::int16_t m_qual = in_m && m.pos(j) == pos ? m.qual(j++) : -1;
+      if (!in_regions(pos))
         continue;
-      const auto other_nuc =
-        is_rev ? (pos > 0 ? seq_nt16_str[bam_seqi(seq, pos - 1)] : '\0')
-               : (pos + 1 < qlen ? seq_nt16_str[bam_seqi(seq, pos + 1)] : '\0');
-      // NOLINTBEGIN(*-constant-array-index)
-      const auto other_enc = encoding[static_cast<std::uint8_t>(other_nuc)];
-      if (other_enc == n_nucs)
+      const auto ctx = context(pos, is_rev);
+      if (sites)
+        add_site(*sites, aln, pos, is_rev, ctx, h_qual, m_qual);
+      if (ctx == no_context)
         continue;
-      if (is_rev) {
-        hydroxy_rev[other_enc][mods[h_idx].qual]++;
-        methyl_rev[other_enc][mods[m_idx].qual]++;
-      }
-      else {
-        hydroxy_fwd[other_enc][mods[h_idx].qual]++;
-        methyl_fwd[other_enc][mods[m_idx].qual]++;
-      }
+      // NOLINTBEGIN(*-constant-array-index)
+      if (h_qual >= 0)
+        (is_rev ? hydroxy_rev : hydroxy_fwd)[ctx][h_qual]++;
+      if (m_qual >= 0)
+        (is_rev ? methyl_rev : methyl_fwd)[ctx][m_qual]++;
+      if (quals && h_qual >= 0)
+        quals->h[h_qual]++;
+      if (quals && m_qual >= 0)
+        quals->m[m_qual]++;
       // NOLINTEND(*-constant-array-index)
     }
   }
 
-  NLOHMANN_DEFINE_TYPE_INTRUSIVE(mod_prob_stats, methyl_fwd, methyl_rev,
-                                 hydroxy_fwd, hydroxy_rev)
+  /* Each code other than C+h and C+m is counted on its own. The modified
+   * base reads along SEQ unless exactly one of the read and the MM strand
+   * is reversed, and the context is taken along that direction.
+   */
+  auto
+  count_other_mods(const bam1_t *aln, const auto &in_regions,
+                   const auto &context) -> void {
+    const auto is_rev = bam_is_rev(aln);
+    for (const auto &e : parser.entries)
+      for (auto j = 0u; j < e.n_codes; ++j) {
+        const mod_key key{e.canonical, e.minus, parser.codes[e.code_beg + j]};
+        if (key == mod_key{'C', false, 'h'} ||
+            key == mod_key{'C', false, 'm'})
+          continue;
+        const auto seq_rev = is_rev != e.minus;
+        auto &hist = get_hist(key);
+        auto &table = seq_rev ? hist.rev : hist.fwd;
+        const auto t = parser.track(e, j);
+        for (auto i = 0u; i < t.size(); ++i) {
+          const auto pos = t.pos(i);
+          if (!in_regions(pos))
+            continue;
+          const auto ctx = context(pos, seq_rev);
+          if (ctx != no_context)
+            table[ctx][t.qual(i)]++;  // NOLINT(*-constant-array-index)
+        }
+      }
+  }
+};
+
+/* Value of an aux tag as text, with numbers formatted into buf. Returns
+ * an empty view if the read does not have the tag.
+ */
+[[nodiscard]] static auto
+aux_value(const bam1_t *aln, const char *tag, std::array<char, 32> &buf)
+  -> std::string_view {
+  const auto data = bam_aux_get(aln, tag);
+  if (!data)
+    return {};
+  std::to_chars_result r{};
+  switch (*data) {
+  case 'A':
+    buf[0] = bam_aux2A(data);
+    return {buf.data(), 1};
+  case 'Z':
+  case 'H':
+    return bam_aux2Z(data);
+  case 'f':
+  case 'd':
+    r = std::to_chars(buf.data(), buf.data() + buf.size(), bam_aux2f(data));
+    break;
+  default:
+    r = std::to_chars(buf.data(), buf.data() + buf.size(), bam_aux2i(data));
+  }
+  return {buf.data(), r.ptr};
+}
+
+/* One mod_prob_stats for each value of an aux tag, or a single one if tag
+ * is empty. Values get dense ids in the order first seen so counting a
+ * read costs one tag lookup and one hash. Reads without the tag go to the
+ * group with an empty name.
+ */
+struct grouped_stats {
+  std::string tag;
+  std::uint32_t width{};
+  std::vector<std::string> names;
+  std::vector<mod_prob_stats> groups;
+
+  // without a tag the one group exists even if no read is counted
+  grouped_stats(std::string tag, const std::uint32_t width) :
+    tag{std::move(tag)}, width{width} {
+    if (this->tag.empty())
+      std::ignore = get_id({});
+  }
+
+  auto
+  operator+=(const grouped_stats &rhs) -> grouped_stats & {
+    for (const auto &[i, name] : std::views::enumerate(rhs.names))
+      groups[get_id(name)] += rhs.groups[i];
+    return *this;
+  }
+
+  [[nodiscard]] auto
+  operator()(const bam1_t *aln, const region_set *regions = nullptr,
+             const ref_targets *ref = nullptr, stage_times *times = nullptr,
+             std::vector<site_call> *sites = nullptr,
+             mod_prob_stats::call_quals *quals = nullptr) -> std::uint32_t {
+    std::array<char, 32> buf{};
+    const auto name = tag.empty() ? std::string_view{}
+                                  : aux_value(aln, tag.data(), buf);
+    return groups[get_id(name)](aln, regions, ref, times, sites, quals);
+  }
+
+private:
+  std::unordered_map<std::string, std::uint32_t, string_hash, std::equal_to<>>
+    ids;
+
+  [[nodiscard]] auto
+  get_id(const std::string_view name) -> std::uint32_t {
+    if (const auto itr = ids.find(name); itr != std::end(ids))
+      return itr->second;
+    const auto id = static_cast<std::uint32_t>(std::size(groups));
+    ids.emplace(name, id);
+    names.emplace_back(name);
+    groups.emplace_back(width);
+    return id;
+  }
 };
 
+/* Contexts are named along the strand of the modified base, so each
+ * reverse row is added to the forward row for the same context.
+ */
 struct mod_prob_stats_fmt {
+  using ctx_map = std::map<std::string, std::vector<std::uint64_t>>;
   std::map<std::string, std::vector<std::uint64_t>> methyl;
   std::map<std::string, std::vector<std::uint64_t>> hydroxy;
+  std::map<std::string, ctx_map> other_mods;
   mod_prob_stats_fmt(const mod_prob_stats &mps) {
-    const auto v_sum = [](auto &a, const auto &b) {
-      std::ranges::transform(a, b, std::begin(a), std::plus{});
-    };
-    const auto sum_to_map = [&](const auto &f, const auto &r) {
-      auto work = f;
-      for (auto i = 0u; i < n_nucs; ++i)
-        v_sum(work[i], r[n_nucs - 1 - i]);
-      std::map<std::string, std::vector<std::uint64_t>> result;
-      for (const auto &[idx, vals] : std::views::enumerate(work))
-        result[dinucs[idx]] = std::vector(std::cbegin(vals), std::cend(vals));
+    const auto width = mps.width;
+    const auto sum_to_map = [width](const char canonical, const auto &f,
+                                    const auto &r) {
+      ctx_map result;
+      for (auto i = 0u; i < n_contexts(width); ++i) {
+        auto vals = std::vector(std::cbegin(f[i]), std::cend(f[i]));
+        std::ranges::transform(vals, r[rc_index(width, i)], std::begin(vals),
+                               std::plus{});
+        result[context_name(canonical, i, width, false)] = std::move(vals);
+      }
       return result;
     };
-    methyl = sum_to_map(mps.methyl_fwd, mps.methyl_rev);
-    hydroxy = sum_to_map(mps.hydroxy_fwd, mps.hydroxy_rev);
+    methyl = sum_to_map('C', mps.methyl_fwd, mps.methyl_rev);
+    hydroxy = sum_to_map('C', mps.hydroxy_fwd, mps.hydroxy_rev);
+    for (const auto &x : mps.other_mods)
+      other_mods[x.key.to_string()] = sum_to_map(x.key.canonical, x.fwd, x.rev);
+  }
+  // other_mods only appears when there are any
+  friend auto
+  to_json(nlohmann::json &j, const mod_prob_stats_fmt &f) -> void {
+    j = {{"methyl", f.methyl}, {"hydroxy", f.hydroxy}};
+    if (!f.other_mods.empty())
+      j["other_mods"] = f.other_mods;
   }
-  NLOHMANN_DEFINE_TYPE_INTRUSIVE(mod_prob_stats_fmt, methyl, hydroxy)
 };
 
 struct mod_prob_stats_fmt_stranded {
+  using ctx_map = std::map<std::string, std::vector<std::uint64_t>>;
   std::map<std::string, std::vector<std::uint64_t>> methyl_fwd;
   std::map<std::string, std::vector<std::uint64_t>> methyl_rev;
   std::map<std::string, std::vector<std::uint64_t>> hydroxy_fwd;
   std::map<std::string, std::vector<std::uint64_t>> hydroxy_rev;
+  std::map<std::string, std::map<std::string, ctx_map>> other_mods;
   mod_prob_stats_fmt_stranded(const mod_prob_stats &mps) {
-    const auto to_map = [&](const auto &x, const auto &y) {
-      std::map<std::string, std::vector<std::uint64_t>> result;
-      for (const auto &[idx, vals] : std::views::enumerate(x))
-        result[y[idx]] = std::vector(std::cbegin(vals), std::cend(vals));
+    const auto width = mps.width;
+    const auto to_map = [width](const char canonical, const auto &x,
+                                const bool rev) {
+      ctx_map result;
+      for (auto i = 0u; i < n_contexts(width); ++i)
+        result[context_name(canonical, i, width, rev)] =
+          std::vector(std::cbegin(x[i]), std::cend(x[i]));
       return result;
     };
-    methyl_fwd = to_map(mps.methyl_fwd, dinucs);
-    methyl_rev = to_map(mps.methyl_rev, dinucs_rev);
-    hydroxy_fwd = to_map(mps.hydroxy_fwd, dinucs);
-    hydroxy_rev = to_map(mps.hydroxy_rev, dinucs_rev);
+    methyl_fwd = to_map('C', mps.methyl_fwd, false);
+    methyl_rev = to_map('C', mps.methyl_rev, true);
+    hydroxy_fwd = to_map('C', mps.hydroxy_fwd, false);
+    hydroxy_rev = to_map('C', mps.hydroxy_rev, true);
+    for (const auto &x : mps.other_mods) {
+      auto &result = other_mods[x.key.to_string()];
+      result["fwd"] = to_map(x.key.canonical, x.fwd, false);
+      result["rev"] = to_map(x.key.canonical, x.rev, true);
+    }
+  }
+  // other_mods only appears when there are any
+  friend auto
+  to_json(nlohmann::json &j, const mod_prob_stats_fmt_stranded &f) -> void {
+    j = {{"methyl_fwd", f.methyl_fwd},
+         {"methyl_rev", f.methyl_rev},
+         {"hydroxy_fwd", f.hydroxy_fwd},
+         {"hydroxy_rev", f.hydroxy_rev}};
+    if (!f.other_mods.empty())
+      j["other_mods"] = f.other_mods;
   }
-  NLOHMANN_DEFINE_TYPE_INTRUSIVE(mod_prob_stats_fmt_stranded, methyl_fwd,
-                                 methyl_rev, hydroxy_fwd, hydroxy_rev)
 };
 
-int
-main(int argc, char *argv[]) {  // NOLINT(*-c-arrays)
-  std::string outfile;
-  std::string infile;
-  bool stranded{};
+// first exception thrown by any of a set of threads
+struct thread_errors {
+  std::atomic_bool failed{};
 
-  CLI::App app{};
-  argv = app.ensure_utf8(argv);
-  app.usage("Usage: nanopore-mods [options]");
+  auto
+  capture() -> void {
+    std::lock_guard lock{mtx};
+    if (!error)
+      error = std::current_exception();
+    failed = true;
+  }
 
-  // clang-format off
-  app.add_option("-i,--input", infile, "BAM/SAM input file")
-    ->required()
-    ->check(CLI::ExistingFile);
-  app.add_option("-o,--output", outfile, "JSON output file")
-    ->required();
+  auto
+  rethrow() -> void {
+    if (error)
+      std::rethrow_exception(error);
+  }
+
+private:
+  std::mutex mtx;
+  std::exception_ptr error;
+};
+
+/* Tables from a run, split by input file and/or by group if requested.
+ * Each key holds the file and the group, left empty when not split that
+ * way.
+ */
+struct summary {
+  using key_t = std::pair<std::string, std::string>;
+  bool per_file{};
+  bool per_group{};
+  std::map<key_t, mod_prob_stats> sections;
+
+  // an empty summary takes the layout of the first one added to it
+  auto
+  operator+=(const summary &rhs) -> summary & {
+    if (rhs.sections.empty())
+      return *this;
+    if (sections.empty()) {
+      per_file = rhs.per_file;
+      per_group = rhs.per_group;
+    }
+    if (rhs.per_file != per_file || rhs.per_group != per_group)
+      throw std::runtime_error("summaries are split in different ways");
+    for (const auto &[key, mps] : rhs.sections)
+      sections.try_emplace(key, mps.width).first->second += mps;
+    return *this;
+  }
+
+  // all sections share the context width
+  [[nodiscard]] auto
+  width() const -> std::uint32_t {
+    const auto w = sections.empty() ? min_context_width
+                                    : std::cbegin(sections)->second.width;
+    if (std::ranges::any_of(sections, [w](const auto &x) {
+          return x.second.width != w;
+        }))
+      throw std::runtime_error("sections have different context widths");
+    return w;
+  }
+};
+
+/* Binary summary, all integers little-endian and every part 8-byte aligned
+ * so tables can be used in place from a mapped file:
+ *
+ *   header (64 bytes): magic "NPMODSUM", u32 version, u32 header size,
+ *     u32 contexts per table, u32 values per context, u32 fixed tables per
+ *     section, u32 number of sections, u32 split (1: by file, 2: by
+ *     group), zero padding
+ *   each section: u32 label length, u32 number of other mods, label padded
+ *     to 8 bytes, then methyl_fwd, methyl_rev, hydroxy_fwd, hydroxy_rev as
+ *     u64[contexts][values], then for each other mod an 8-byte key (u8
+ *     canonical base, u8 strand '+' or '-', u16 zero, i32 code) followed by
+ *     its fwd and rev tables
+ *
+ * The label is the file, the group or both separated by a tab, and is
+ * empty when the summary is not split.
+ */
+struct binary_format {
+  static constexpr std::string_view magic = "NPMODSUM";
+  static constexpr std::uint32_t version = 1;
+  static constexpr std::uint32_t header_size = 64;
+  static constexpr std::uint32_t n_fixed_tables = 4;
+  static constexpr std::uint32_t split_file = 1;
+  static constexpr std::uint32_t split_group = 2;
+  static constexpr auto align = 8u;
+
+  [[nodiscard]] static auto
+  to_label(const summary &s, const summary::key_t &key) -> std::string {
+    const auto &[file, group] = key;
+    if (s.per_file && s.per_group)
+      return file + '\t' + group;
+    return s.per_file ? file : group;
+  }
+
+  [[nodiscard]] static auto
+  from_label(const summary &s, const std::string &label) -> summary::key_t {
+    if (s.per_file && s.per_group) {
+      const auto tab = label.find('\t');
+      if (tab == std::string::npos)
+        throw std::runtime_error("bad section label: " + label);
+      return {label.substr(0, tab), label.substr(tab + 1)};
+    }
+    return s.per_file ? summary::key_t{label, {}} : summary::key_t{{}, label};
+  }
+};
+
+template <typename T>
+static auto
+write_le(std::ostream &out, T x) -> void {
+  if constexpr (std::endian::native == std::endian::big)
+    x = std::byteswap(x);
+  out.write(reinterpret_cast<const char *>(&x), sizeof(x));  // NOLINT
+}
+
+static auto
+write_table(std::ostream &out, const mod_prob_stats::table_t &t) -> void {
+  if constexpr (std::endian::native == std::endian::little)
+    out.write(reinterpret_cast<const char *>(t.counts.data()),  // NOLINT
+              std::ssize(t.counts) * sizeof(std::uint64_t));
+  else
+    for (const auto x : t.counts)
+      write_le(out, x);
+}
+
+static auto
+write_binary(std::ostream &out, const summary &s) -> void {
+  const auto write_zeros = [&](const std::size_t n) {
+    out.write(std::string(n, '\0').data(), static_cast<std::streamsize>(n));
+  };
+  const auto width = s.width();
+  out.write(binary_format::magic.data(), std::size(binary_format::magic));
+  write_le(out, binary_format::version);
+  write_le(out, binary_format::header_size);
+  write_le(out, n_contexts(width));
+  write_le(out, static_cast<std::uint32_t>(mod_prob_stats::n_values));
+  write_le(out, binary_format::n_fixed_tables);
+  write_le(out, static_cast<std::uint32_t>(std::size(s.sections)));
+  write_le(out, (s.per_file ? binary_format::split_file : 0u) |
+                  (s.per_group ? binary_format::split_group : 0u));
+  const auto header_used = std::size(binary_format::magic) + 7 * 4;
+  write_zeros(binary_format::header_size - header_used);
+
+  for (const auto &[key, mps] : s.sections) {
+    const auto label = binary_format::to_label(s, key);
+    write_le(out, static_cast<std::uint32_t>(std::size(label)));
+    write_le(out, static_cast<std::uint32_t>(std::size(mps.other_mods)));
+    out.write(label.data(), std::ssize(label));
+    write_zeros((binary_format::align - std::size(label) % binary_format::align) %
+                binary_format::align);
+
+    write_table(out, mps.methyl_fwd);
+    write_table(out, mps.methyl_rev);
+    write_table(out, mps.hydroxy_fwd);
+    write_table(out, mps.hydroxy_rev);
+    for (const auto &x : mps.other_mods) {
+      write_le(out, static_cast<std::uint8_t>(x.key.canonical));
+      write_le(out, static_cast<std::uint8_t>(x.key.minus ? '-' : '+'));
+      write_le(out, std::uint16_t{});
+      write_le(out, static_cast<std::int32_t>(x.key.code));
+      write_table(out, x.fwd);
+      write_table(out, x.rev);
+    }
+  }
+}
+
+template <typename T>
+[[nodiscard]] static auto
+read_le(std::istream &in) -> T {
+  T x{};
+  in.read(reinterpret_cast<char *>(&x), sizeof(x));  // NOLINT
+  if constexpr (std::endian::native == std::endian::big)
+    x = std::byteswap(x);
+  return x;
+}
+
+static auto
+read_table(std::istream &in, mod_prob_stats::table_t &t) -> void {
+  if constexpr (std::endian::native == std::endian::little)
+    in.read(reinterpret_cast<char *>(t.counts.data()),  // NOLINT
+            std::ssize(t.counts) * sizeof(std::uint64_t));
+  else
+    for (auto &x : t.counts)
+      x = read_le<std::uint64_t>(in);
+}
+
+[[nodiscard]] static auto
+read_binary(std::istream &in, const std::string &filename) -> summary {
+  const auto fail = [&](const std::string &msg) {
+    throw std::runtime_error(msg + ": " + filename);
+  };
+  const auto start = in.tellg();  // the summary may follow other data
+  std::string magic(std::size(binary_format::magic), '\0');
+  in.read(magic.data(), std::ssize(magic));
+  if (magic != binary_format::magic)
+    fail("not a binary summary");
+  if (read_le<std::uint32_t>(in) != binary_format::version)
+    fail("unsupported binary summary version");
+  const auto header_size = read_le<std::uint32_t>(in);
+  const auto n_ctx = read_le<std::uint32_t>(in);
+  auto width = min_context_width;
+  while (width < max_context_width && n_contexts(width) < n_ctx)
+    ++width;
+  if (n_contexts(width) != n_ctx ||
+      read_le<std::uint32_t>(in) != mod_prob_stats::n_values ||
+      read_le<std::uint32_t>(in) != binary_format::n_fixed_tables)
+    fail("incompatible table layout");
+  const auto n_sections = read_le<std::uint32_t>(in);
+  const auto split = read_le<std::uint32_t>(in);
+  in.seekg(start + std::streamoff{header_size});
+
+  summary s;
+  s.per_file = (split & binary_format::split_file) != 0;
+  s.per_group = (split & binary_format::split_group) != 0;
+  for (auto i = 0u; i < n_sections && in; ++i) {
+    const auto label_len = read_le<std::uint32_t>(in);
+    const auto n_other = read_le<std::uint32_t>(in);
+    std::string label(label_len, '\0');
+    in.read(label.data(), label_len);
+    in.seekg((binary_format::align - label_len % binary_format::align) %
+               binary_format::align,
+             std::ios::cur);
+
+    auto &mps =
+      s.sections.try_emplace(binary_format::from_label(s, label), width)
+        .first->second;
+    read_table(in, mps.methyl_fwd);
+    read_table(in, mps.methyl_rev);
+    read_table(in, mps.hydroxy_fwd);
+    read_table(in, mps.hydroxy_rev);
+    for (auto j = 0u; j < n_other; ++j) {
+      const auto canonical = read_le<std::uint8_t>(in);
+      const auto strand = read_le<std::uint8_t>(in);
+      std::ignore = read_le<std::uint16_t>(in);
+      const auto code = read_le<std::int32_t>(in);
+      auto &hist =
+        mps.get_hist({static_cast<char>(canonical), strand == '-', code});
+      read_table(in, hist.fwd);
+      read_table(in, hist.rev);
+    }
+  }
+  if (!in)
+    fail("truncated binary summary");
+  return s;
+}
+
+/* Loads JSON written by either formatter. Unstranded counts go to the fwd
+ * tables, which the unstranded formatter sums back to the same values.
+ */
+[[nodiscard]] static auto
+read_json(std::istream &in, const std::string &filename, bool &stranded)
+  -> summary {
+  const auto j = nlohmann::json::parse(in);
+  const auto fail = [&](const std::string &msg) {
+    throw std::runtime_error(msg + ": " + filename);
+  };
+  summary s;
+  const auto load = [&](const nlohmann::json &x, const char canonical,
+                        const bool rev, const std::uint32_t width,
+                        mod_prob_stats::table_t &t) {
+    for (auto i = 0u; i < n_contexts(width); ++i) {
+      const auto &vals = x.at(context_name(canonical, i, width, rev));
+      if (std::size(vals) != mod_prob_stats::n_values)
+        fail("incompatible table layout");
+      std::ranges::copy(vals.template get<std::vector<std::uint64_t>>(),
+                        std::begin(t[i]));
+    }
+  };
+  const auto load_stats = [&](const nlohmann::json &x,
+                              const summary::key_t &section) {
+    const auto x_stranded = x.contains("methyl_fwd");
+    stranded = stranded && x_stranded;
+    const auto &methyl = x.at(x_stranded ? "methyl_fwd" : "methyl");
+    const auto width =
+      methyl.empty() ? 0 : context_width(methyl.begin().key());
+    if (width == 0)
+      fail("incompatible table layout");
+    auto &mps = s.sections.try_emplace(section, width).first->second;
+    if (x_stranded) {
+      load(x.at("methyl_fwd"), 'C', false, width, mps.methyl_fwd);
+      load(x.at("methyl_rev"), 'C', true, width, mps.methyl_rev);
+      load(x.at("hydroxy_fwd"), 'C', false, width, mps.hydroxy_fwd);
+      load(x.at("hydroxy_rev"), 'C', true, width, mps.hydroxy_rev);
+    }
+    else {
+      load(x.at("methyl"), 'C', false, width, mps.methyl_fwd);
+      load(x.at("hydroxy"), 'C', false, width, mps.hydroxy_fwd);
+    }
+    if (x.contains("other_mods"))
+      for (const auto &[name, y] : x["other_mods"].items()) {
+        const auto key = mod_key::from_string(name);
+        auto &hist = mps.get_hist(key);
+        if (x_stranded) {
+          load(y.at("fwd"), key.canonical, false, width, hist.fwd);
+          load(y.at("rev"), key.canonical, true, width, hist.rev);
+        }
+        else
+          load(y, key.canonical, false, width, hist.fwd);
+      }
+  };
+
+  stranded = true;
+  const auto load_groups = [&](const nlohmann::json &x,
+                               const std::string &file) {
+    if (!s.per_group)
+      load_stats(x, {file, {}});
+    else
+      for (const auto &[group, y] : x.at("groups").items())
+        load_stats(y, {file, group});
+  };
+  s.per_file = j.contains("files");
+  if (s.per_file) {
+    const auto &files = j["files"];
+    s.per_group = !files.empty() && files.begin()->contains("groups");
+    for (const auto &[file, x] : files.items())
+      load_groups(x, file);
+  }
+  else {
+    s.per_group = j.contains("groups");
+    load_groups(j, {});
+  }
+  return s;
+}
+
+// format is detected from the first bytes of the file
+[[nodiscard]] static auto
+read_summary(const std::string &filename, bool &stranded) -> summary {
+  std::ifstream in(filename, std::ios::binary);
+  if (!in)
+    throw std::runtime_error("failed to open file: " + filename);
+  std::string magic(std::size(binary_format::magic), '\0');
+  in.read(magic.data(), std::ssize(magic));
+  in.clear();
+  in.seekg(0);
+  stranded = true;  // binary summaries keep strands
+  return magic == binary_format::magic ? read_binary(in, filename)
+                                       : read_json(in, filename, stranded);
+}
+
+/* Unsplit summaries are written at the top level as before. Otherwise
+ * each file and then each group gets its own object:
+ * {"files": {file: {"groups": {group: {...}}}}}
+ */
+[[nodiscard]] static auto
+summary_to_json(const summary &s, const bool stranded) -> nlohmann::json {
+  auto j = nlohmann::json::object();
+  for (const auto &[key, mps] : s.sections) {
+    const auto &[file, group] = key;
+    auto &node = s.per_file ? j["files"][file] : j;
+    auto &leaf = s.per_group ? node["groups"][group] : node;
+    leaf = stranded ? nlohmann::json(mod_prob_stats_fmt_stranded(mps))
+                    : nlohmann::json(mod_prob_stats_fmt(mps));
+  }
+  return j;
+}
+
+/* With metrics, JSON output gets a run_metrics block, and each item of
+ * info becomes a block of its own. The binary format has no place for
+ * these so they go to stderr instead.
+ */
+static auto
+write_output(const std::string &outfile, const std::string &output_format,
+             const bool stranded, const summary &s,
+             run_metrics *metrics = nullptr,
+             const nlohmann::json &info = nlohmann::json::object()) -> void {
+  const auto binary = output_format == "binary";
+  std::ofstream out(outfile, binary ? std::ios::binary : std::ios::out);
+  if (!out)
+    throw std::runtime_error("Error opening output file: " + outfile);
+
+  if (binary) {
+    write_binary(out, s);
+    if (metrics)
+      std::println(std::cerr, "run_metrics: {}", metrics->to_json().dump());
+    for (const auto &[name, x] : info.items())
+      std::println(std::cerr, "{}: {}", name, x.dump());
+    return;
+  }
+  auto t = stage_times::clock::now();
+  auto j = summary_to_json(s, stranded);
+  if (metrics) {
+    stage_times times;
+    times.lap(stage_times::format, t);
+    metrics->add(times);
+    j["run_metrics"] = metrics->to_json();
+  }
+  j.update(info);
+  std::println(out, "{}", j.dump(4));
+}
+
+/* Sums summaries written by earlier runs. Workers each load and add files
+ * in turn and their totals are summed at the end. Strand-specific output,
+ * including binary, needs every input to be strand-specific.
+ */
+[[nodiscard]] static auto
+merge_summaries(const std::vector<std::string> &infiles,
+                const std::uint32_t n_workers, const bool need_stranded)
+  -> summary {
+  std::atomic_size_t next_file{};
+  thread_errors errors;
+
+  std::vector<summary> worker_sums(
+    std::min<std::size_t>(n_workers, std::size(infiles)));
+  std::vector<std::jthread> workers;
+  for (auto &sum : worker_sums)
+    workers.emplace_back([&infiles, &next_file, &errors, need_stranded, &sum] {
+      try {
+        std::size_t i{};
+        while (!errors.failed && (i = next_file++) < std::size(infiles)) {
+          bool stranded{};
+          sum += read_summary(infiles[i], stranded);
+          if (need_stranded && !stranded)
+            throw std::runtime_error("not strand-specific: " + infiles[i]);
+        }
+      }
+      catch (...) {
+        errors.capture();
+      }
+    });
+  workers.clear();  // joins
+  errors.rethrow();
+
+  summary s;
+  for (const auto &sum : worker_sums)
+    s += sum;
+  return s;
+}
+
+// a section for each slot of results and each group in it
+[[nodiscard]] static auto
+make_summary(const std::vector<grouped_stats> &results,
+             const std::vector<std::string> &infiles, const bool per_file)
+  -> summary {
+  summary s;
+  s.per_file = per_file;
+  s.per_group = !results.empty() && !results.front().tag.empty();
+  for (const auto &[i, slot] : std::views::enumerate(results)) {
+    const auto file = per_file ? infiles[i] : std::string{};
+    // a slot that counted nothing still gets a section, of zeros
+    if (slot.names.empty())
+      s.sections.try_emplace({file, ""}, slot.width);
+    for (const auto &[j, name] : std::views::enumerate(slot.names))
+      s.sections.try_emplace({file, name}, slot.width).first->second +=
+        slot.groups[j];
+  }
+  return s;
+}
+
+/* Tables saved during a run over one BGZF input so a later run can carry
+ * on from the record after the last save. The file has a preamble with
+ * the virtual offset of that record, then the input name and size and the
+ * settings that decide what is counted: the group tag, the per-file
+ * split, the context width, the read filters and the reference name and
+ * size. All of these must match on resume. A binary summary follows. Each
+ * save goes to a temporary file that is then renamed over the last one,
+ * so a crash while saving leaves the previous checkpoint intact.
+ */
+struct checkpoint {
+  static constexpr std::string_view magic = "NPMODCKP";
+  static constexpr std::uint32_t version = 3;
+
+  std::string filename;
+  std::string input;
+  std::string group_tag;
+  bool per_file{};
+  std::uint32_t width{};
+  read_filter filter;
+  std::string ref_file;  // empty if contexts come from the reads
+  std::chrono::seconds interval{};
+  summary restored;         // from the checkpoint resumed, if any
+  std::int64_t offset{-1};  // of the record to resume from, -1 for none
+
+  checkpoint(std::string filename, std::string input, std::string group_tag,
+             const bool per_file, const std::uint32_t width,
+             const read_filter &filter, std::string ref_file,
+             const std::chrono::seconds interval) :
+    filename{std::move(filename)}, input{std::move(input)},
+    group_tag{std::move(group_tag)}, per_file{per_file}, width{width},
+    filter{filter}, ref_file{std::move(ref_file)}, interval{interval},
+    input_size{std::filesystem::file_size(this->input)},
+    ref_size{this->ref_file.empty()
+               ? 0
+               : std::filesystem::file_size(this->ref_file)} {}
+
+  [[nodiscard]] auto
+  due() const -> bool {
+    return stage_times::clock::now() - last_save >= interval;
+  }
+
+  /* s holds the tables for records before next. The new file reaches the
+   * disk before it replaces the old one, and the rename itself is synced,
+   * so losing the machine leaves one or the other.
+   */
+  auto
+  save(const summary &s, const std::int64_t next) -> void {
+    summary all;
+    all += restored;
+    all += s;
+    const auto tmp = filename + ".tmp";
+    {
+      std::ofstream out(tmp, std::ios::binary);
+      if (!out)
+        throw std::runtime_error("failed to open file: " + tmp);
+      out.write(magic.data(), std::size(magic));
+      write_le(out, version);
+      write_le(out, next);
+      write_le(out, static_cast<std::uint64_t>(input_size));
+      write_string(out, input);
+      write_string(out, group_tag);
+      write_le(out, static_cast<std::uint8_t>(per_file));
+      write_le(out, width);
+      write_le(out, filter.exclude_flags);
+      write_le(out, filter.min_mapq);
+      write_le(out, filter.min_read_length);
+      write_le(out, std::bit_cast<std::uint64_t>(filter.fraction));
+      write_le(out, filter.seed);
+      write_string(out, ref_file);
+      write_le(out, static_cast<std::uint64_t>(ref_size));
+      write_binary(out, all);
+      if (!out.flush())
+        throw std::runtime_error("failed to write file: " + tmp);
+    }
+    sync_to_disk(tmp, O_WRONLY);
+    std::filesystem::rename(tmp, filename);
+    const auto dir = std::filesystem::path(filename).parent_path();
+    sync_to_disk(dir.empty() ? "." : dir.string(), O_RDONLY | O_DIRECTORY);
+    last_save = stage_times::clock::now();
+  }
+
+  // returns false if there is no checkpoint to resume from
+  [[nodiscard]] auto
+  load() -> bool {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in)
+      return false;
+    const auto fail = [&](const std::string &msg) {
+      throw std::runtime_error(msg + ": " + filename);
+    };
+    std::string m(std::size(magic), '\0');
+    in.read(m.data(), std::ssize(m));
+    if (m != magic || read_le<std::uint32_t>(in) != version)
+      fail("not a checkpoint");
+    const auto next = read_le<std::int64_t>(in);
+    const auto size = read_le<std::uint64_t>(in);
+    const auto name = read_string(in);
+    const auto tag = read_string(in);
+    const auto split = read_le<std::uint8_t>(in) != 0;
+    const auto w = read_le<std::uint32_t>(in);
+    read_filter f;
+    f.exclude_flags = read_le<std::uint16_t>(in);
+    f.min_mapq = read_le<std::uint32_t>(in);
+    f.min_read_length = read_le<std::int32_t>(in);
+    f.fraction = std::bit_cast<double>(read_le<std::uint64_t>(in));
+    f.seed = read_le<std::uint64_t>(in);
+    const auto ref_name = read_string(in);
+    const auto rsize = read_le<std::uint64_t>(in);
+    if (!in)
+      fail("truncated checkpoint");
+    if (name != input || size != input_size)
+      fail("checkpoint is for a different input");
+    if (tag != group_tag)
+      fail("checkpoint is for a different --group-by");
+    if (split != per_file)
+      fail("checkpoint is for a different --per-file");
+    if (w != width)
+      fail(std::format("checkpoint is for --context {}", w));
+    if (f != filter)
+      fail("checkpoint is for different read filters or sampling");
+    if (ref_name != ref_file || rsize != ref_size)
+      fail(ref_name.empty() ? "checkpoint is for a run without --reference"
+                            : "checkpoint is for --reference " + ref_name);
+    restored = read_binary(in, filename);
+    offset = next;
+    return true;
+  }
+
+  auto
+  remove() const -> void {
+    std::filesystem::remove(filename);
+  }
+
+private:
+  std::uintmax_t input_size{};
+  std::uintmax_t ref_size{};
+  stage_times::time_point last_save{stage_times::clock::now()};
+
+  static auto
+  write_string(std::ostream &out, const std::string &x) -> void {
+    write_le(out, static_cast<std::uint32_t>(std::size(x)));
+    out.write(x.data(), std::ssize(x));
+  }
+
+  [[nodiscard]] static auto
+  read_string(std::istream &in) -> std::string {
+    std::string x(read_le<std::uint32_t>(in), '\0');
+    in.read(x.data(), std::ssize(x));
+    return x;
+  }
+
+  // flushes a file, or the entries of a directory, to the disk
+  static auto
+  sync_to_disk(const std::string &path, const int flags) -> void {
+    const auto fd = ::open(path.data(), flags);
+    const auto ok = fd >= 0 && fsync(fd) == 0;
+    if (fd >= 0)
+      ::close(fd);
+    if (!ok)
+      throw std::runtime_error("failed to sync: " + path);
+  }
+};
+
+template <typename T> class bounded_queue {
+public:
+  explicit bounded_queue(const std::size_t capacity) : capacity{capacity} {}
+
+  auto
+  push(T x) -> void {
+    std::unique_lock lock{mtx};
+    not_full.wait(lock, [&] { return q.size() < capacity; });
+    q.push_back(std::move(x));
+    not_empty.notify_one();
+  }
+
+  // returns false once the queue is closed and drained
+  [[nodiscard]] auto
+  pop(T &x) -> bool {
+    std::unique_lock lock{mtx};
+    not_empty.wait(lock, [&] { return !q.empty() || closed; });
+    if (q.empty())
+      return false;
+    x = std::move(q.front());
+    q.pop_front();
+    not_full.notify_one();
+    return true;
+  }
+
+  auto
+  close() -> void {
+    std::lock_guard lock{mtx};
+    closed = true;
+    not_empty.notify_all();
+  }
+
+private:
+  std::size_t capacity{};
+  bool closed{};
+  std::deque<T> q;
+  std::mutex mtx;
+  std::condition_variable not_empty;
+  std::condition_variable not_full;
+};
+
+/* A fixed number of records whose bam1_t objects, and so their data
+ * buffers, are reused each time the batch is filled. All records in a
+ * batch come from the same input file.
+ */
+struct record_batch {
+  static constexpr auto capacity = 64u;
+  std::vector<bam1_t *> recs;
+  std::size_t n_recs{};
+  std::size_t file_idx{};
+  std::uint64_t seq{};  // order in which batches were passed on
+
+  record_batch() : recs(capacity) { std::ranges::generate(recs, bam_init1); }
+  ~record_batch() { std::ranges::for_each(recs, bam_destroy1); }
+  record_batch(const record_batch &) = delete;
+  auto
+  operator=(const record_batch &) -> record_batch & = delete;
+
+  [[nodiscard]] auto
+  records() const {
+    return std::span{recs}.first(n_recs);
+  }
+};
+
+using batch_queue = bounded_queue<record_batch *>;
+
+/* How CRAM inputs are decoded: the reference to decode against, if not
+ * found through the header and REF_PATH/REF_CACHE as htslib does by
+ * default, and the sam_fields to decode, or 0 for all of them.
+ */
+struct cram_args {
+  std::string reference;
+  std::uint32_t required_fields{};
+
+  auto
+  apply(htsFile *in, const std::string &filename) const -> void {
+    if (!reference.empty() && hts_set_fai_filename(in, reference.data()) < 0)
+      throw std::runtime_error("failed to set CRAM reference for: " +
+                               filename);
+    if (required_fields &&
+        (hts_set_opt(in, CRAM_OPT_REQUIRED_FIELDS, required_fields) < 0 ||
+         hts_set_opt(in, CRAM_OPT_DECODE_MD, 0) < 0))
+      throw std::runtime_error("failed to set CRAM options for: " + filename);
+  }
+};
+
+/* An open input with its header and, if it will be queried, its index.
+ * With an iterator set, records are read through it.
+ */
+struct input_file {
+  std::string filename;
+  std::unique_ptr<htsFile, int (*)(htsFile *)> in{nullptr, &hts_close};
+  std::unique_ptr<sam_hdr_t, void (*)(sam_hdr_t *)> hdr{nullptr,
+                                                        &bam_hdr_destroy};
+  std::unique_ptr<hts_idx_t, void (*)(hts_idx_t *)> idx{nullptr,
+                                                        &hts_idx_destroy};
+  std::unique_ptr<hts_itr_t, void (*)(hts_itr_t *)> itr{nullptr,
+                                                        &hts_itr_destroy};
+
+  input_file(const std::string &filename, htsThreadPool &tp,
+             const cram_args *cram = nullptr) :
+    filename{filename}, in{hts_open(filename.data(), "r"), &hts_close} {
+    if (!in)
+      throw std::runtime_error("failed to open file: " + filename);
+    if (tp.pool && hts_set_opt(in.get(), HTS_OPT_THREAD_POOL, &tp) < 0)
+      throw std::runtime_error("failed to set thread pool for: " + filename);
+    if (cram && in->is_cram)
+      cram->apply(in.get(), filename);
+    hdr.reset(sam_hdr_read(in.get()));
+    if (!hdr)
+      throw std::runtime_error("failed to parse header from file: " +
+                               filename);
+  }
+
+  auto
+  load_index() -> void {
+    idx.reset(sam_index_load(in.get(), filename.data()));
+    if (!idx)
+      throw std::runtime_error("failed to load index for: " + filename);
+  }
+
+  // returns false if there is nothing to query
+  [[nodiscard]] auto
+  query(const region_set &regions) -> bool {
+    auto reg_strs = regions.to_strings(hdr.get());
+    if (reg_strs.empty())
+      return false;
+    std::vector<char *> reg_ptrs;
+    for (auto &r : reg_strs)
+      reg_ptrs.push_back(r.data());
+    itr.reset(sam_itr_regarray(idx.get(), hdr.get(), reg_ptrs.data(),
+                               std::size(reg_ptrs)));
+    if (!itr)
+      throw std::runtime_error("failed to query regions in: " + filename);
+    return true;
+  }
+
+  [[nodiscard]] auto
+  read1(bam1_t *aln) -> std::int32_t {
+    return itr ? sam_itr_next(in.get(), itr.get(), aln)
+               : sam_read1(in.get(), hdr.get(), aln);
+  }
+};
+
+/* Copy of every record read from an input, written unchanged. BAM unless
+ * the file name says otherwise, compressed on the shared thread pool.
+ */
+struct passthrough_file {
+  std::string filename;
+  std::unique_ptr<htsFile, int (*)(htsFile *)> out{nullptr, &hts_close};
+  const sam_hdr_t *hdr{};
+
+  passthrough_file(const std::string &filename, const sam_hdr_t *hdr,
+                   htsThreadPool &tp) : filename{filename}, hdr{hdr} {
+    std::array<char, 8> mode{"w"};
+    if (sam_open_mode(mode.data() + 1, filename.data(), nullptr) < 0)
+      mode[1] = 'b';
+    out.reset(hts_open(filename.data(), mode.data()));
+    if (!out)
+      throw std::runtime_error("failed to open file: " + filename);
+    if (tp.pool && hts_set_opt(out.get(), HTS_OPT_THREAD_POOL, &tp) < 0)
+      throw std::runtime_error("failed to set thread pool for: " + filename);
+    if (sam_hdr_write(out.get(), hdr) < 0)
+      throw std::runtime_error("failed to write header to: " + filename);
+  }
+
+  auto
+  write(const std::span<bam1_t *const> recs) -> void {
+    for (const auto aln : recs)
+      if (sam_write1(out.get(), hdr, aln) < 0)
+        throw std::runtime_error("failed to write record to: " + filename);
+  }
+
+  // flushing happens on close, so errors are only known here
+  auto
+  close() -> void {
+    if (hts_close(out.release()) < 0)
+      throw std::runtime_error("failed to close file: " + filename);
+  }
+};
+
+/* Text written through BGZF, compressed on the shared thread pool if the
+ * file name ends in .gz and uncompressed otherwise. - is stdout.
+ */
+struct text_output {
+  std::string filename;
+  std::unique_ptr<BGZF, int (*)(BGZF *)> out{nullptr, &bgzf_close};
+
+  text_output(const std::string &filename, htsThreadPool &tp) :
+    filename{filename} {
+    const auto compress = filename.ends_with(".gz");
+    out.reset(bgzf_open(filename.data(), compress ? "w" : "wu"));
+    if (!out)
+      throw std::runtime_error("failed to open file: " + filename);
+    if (compress && tp.pool &&
+        bgzf_thread_pool(out.get(), tp.pool, tp.qsize) < 0)
+      throw std::runtime_error("failed to set thread pool for: " + filename);
+  }
+
+  auto
+  write(const std::string_view s) -> void {
+    if (bgzf_write(out.get(), s.data(), std::size(s)) < 0)
+      throw std::runtime_error("failed to write to: " + filename);
+  }
+
+  auto
+  close() -> void {
+    if (bgzf_close(out.release()) < 0)
+      throw std::runtime_error("failed to close file: " + filename);
+  }
+};
+
+/* Hands items to consume in the order of their sequence numbers, starting
+ * from 0, whichever thread pushes them. consume runs on the pushing thread
+ * with the lock held so it needs no locking of its own. Items pushed
+ * before their batch goes back to the pool are bounded by the number of
+ * batches.
+ */
+template <typename T> class ordered_sink {
+public:
+  explicit ordered_sink(std::function<void(T &)> consume) :
+    consume{std::move(consume)} {}
+
+  auto
+  push(const std::uint64_t seq, T x) -> void {
+    std::lock_guard lock{mtx};
+    pending.emplace(seq, std::move(x));
+    // taken out first so an item that throws is not consumed again
+    while (!pending.empty() && pending.begin()->first == next) {
+      auto item = std::move(pending.begin()->second);
+      pending.erase(pending.begin());
+      ++next;
+      consume(item);
+    }
+  }
+
+private:
+  std::function<void(T &)> consume;
+  std::uint64_t next{};
+  std::map<std::uint64_t, T> pending;
+  std::mutex mtx;
+};
+
+/* Per-site counts written as bedMethyl, as modkit pileup does, from the
+ * calls of coordinate-sorted reads. No later read starts before the
+ * latest one, so the sites before it are final and are written out and
+ * dropped, which keeps about one read length of sites in memory. Each
+ * call goes to the most likely of canonical, h and m, or counts as failed
+ * if that is below the threshold. A row is written for each code seen at
+ * a site and strand, with the probabilities of that code summed in an
+ * extra last column.
+ */
+struct pileup {
+  // reads without a reference sort last, as with samtools sort
+  using read_start = std::pair<std::uint32_t, hts_pos_t>;
+
+  struct batch {
+    std::vector<read_start> starts;
+    std::vector<site_call> calls;
+  };
+
+  struct counts {
+    std::uint32_t n_h{};
+    std::uint32_t n_m{};
+    std::uint32_t n_canonical{};
+    std::uint32_t n_fail{};
+    bool has_h{};
+    bool has_m{};
+    double sum_h{};
+    double sum_m{};
+  };
+
+  double threshold{};
+  bool cpg_only{};
+  text_output out;
+  std::vector<std::string> names;
+
+  pileup(const std::string &filename, htsThreadPool &tp,
+         const double threshold, const bool cpg_only) :
+    threshold{threshold}, cpg_only{cpg_only}, out{filename, tp} {}
+
+  [[nodiscard]] static auto
+  start_of(const bam1_t *aln) -> read_start {
+    return {static_cast<std::uint32_t>(aln->core.tid), aln->core.pos};
+  }
+
+  // called before the first batch from an input
+  auto
+  set_targets(const sam_hdr_t *hdr) -> void {
+    names.clear();
+    for (std::int32_t tid = 0; tid < sam_hdr_nref(hdr); ++tid)
+      names.emplace_back(sam_hdr_tid2name(hdr, tid));
+  }
+
+  auto
+  add(const batch &b) -> void {
+    for (const auto &start : b.starts) {
+      if (start < last)
+        throw std::runtime_error("--pileup requires coordinate-sorted input");
+      last = start;
+    }
+    for (const auto &c : b.calls)
+      if (c.pos >= 0 && (!cpg_only || c.cpg))
+        add_call(c);
+    flush_before(last);
+  }
+
+  auto
+  finish() -> void {
+    flush_before({~0u, 0});
+    out.close();
+  }
+
+private:
+  using site_key = std::tuple<std::int32_t, hts_pos_t, bool>;
+
+  read_start last{};
+  std::map<site_key, counts> active;
+  std::string line;
+
+  auto
+  add_call(const site_call &c) -> void {
+    auto &x = active[{c.tid, c.pos, c.rev}];
+    const auto p_h = c.h_prob();
+    const auto p_m = c.m_prob();
+    const auto p_canonical = std::max(0.0, 1.0 - p_h - p_m);
+    x.has_h = x.has_h || c.h_qual >= 0;
+    x.has_m = x.has_m || c.m_qual >= 0;
+    x.sum_h += p_h;
+    x.sum_m += p_m;
+    if (std::max({p_canonical, p_h, p_m}) < threshold)
+      ++x.n_fail;
+    else if (p_canonical >= p_h && p_canonical >= p_m)
+      ++x.n_canonical;
+    else if (p_m >= p_h)
+      ++x.n_m;
+    else
+      ++x.n_h;
+  }
+
+  auto
+  flush_before(const read_start start) -> void {
+    line.clear();
+    auto itr = std::begin(active);
+    for (; itr != std::end(active); ++itr) {
+      const auto &[key, x] = *itr;
+      const auto &[tid, pos, rev] = key;
+      if (read_start{static_cast<std::uint32_t>(tid), pos} >= start)
+        break;
+      if (x.has_h)
+        format_row(tid, pos, rev, 'h', x.n_h, x.n_m, x.sum_h, x);
+      if (x.has_m)
+        format_row(tid, pos, rev, 'm', x.n_m, x.n_h, x.sum_m, x);
+    }
+    active.erase(std::begin(active), itr);
+    out.write(line);
+  }
+
+  auto
+  format_row(const std::int32_t tid, const hts_pos_t pos, const bool rev,
+             const char code, const std::uint32_t n_mod,
+             const std::uint32_t n_other, const double sum,
+             const counts &x) -> void {
+    const auto n_valid = x.n_h + x.n_m + x.n_canonical;
+    const auto percent = n_valid ? 100.0 * n_mod / n_valid : 0.0;
+    // NOLINTNEXTLINE(*-constant-array-index)
+    std::format_to(std::back_inserter(line),
+                   "{}\t{}\t{}\t{}\t{}\t{}\t{}\t{}\t255,0,0\t{}\t{:.2f}"
+                   "\t{}\t{}\t{}\t0\t{}\t0\t0\t{:.3f}\n",
+                   names[tid], pos, pos + 1, code, n_valid, rev ? '-' : '+',
+                   pos, pos + 1, n_valid, percent, n_mod, x.n_canonical,
+                   n_other, x.n_fail, sum);
+  }
+};
+
+/* One TSV row for each counted read with its C+h/C+m calls: the number
+ * of calls, the mean m and h probabilities, and the calls with each at or
+ * above the threshold. Rows are formatted by the workers and written in
+ * input order.
+ */
+struct per_read_output {
+  double threshold{};
+  text_output out;
+  std::vector<std::vector<std::string>> names;  // targets of each input
+
+  per_read_output(const std::string &filename, htsThreadPool &tp,
+                  const double threshold) :
+    threshold{threshold}, out{filename, tp} {
+    out.write("#read_id\tchrom\tstrand\tn_calls\tmean_m\tmean_h\t"
+              "n_m_above\tn_h_above\n");
+  }
+
+  // called before the first batch from input i
+  auto
+  set_targets(const std::size_t i, const sam_hdr_t *hdr) -> void {
+    names[i].clear();
+    for (std::int32_t tid = 0; tid < sam_hdr_nref(hdr); ++tid)
+      names[i].emplace_back(sam_hdr_tid2name(hdr, tid));
+  }
+
+  auto
+  format(const bam1_t *aln, const std::size_t file_idx,
+         const std::span<const site_call> calls, std::string &rows) const
+    -> void {
+    double sum_h{};
+    double sum_m{};
+    std::uint32_t n_h{};
+    std::uint32_t n_m{};
+    std::uint32_t n_h_above{};
+    std::uint32_t n_m_above{};
+    for (const auto &c : calls) {
+      n_h += c.h_qual >= 0;
+      n_m += c.m_qual >= 0;
+      sum_h += c.h_prob();
+      sum_m += c.m_prob();
+      n_h_above += c.h_qual >= 0 && c.h_prob() >= threshold;
+      n_m_above += c.m_qual >= 0 && c.m_prob() >= threshold;
+    }
+    const auto mean = [](const double sum, const std::uint32_t n) {
+      return n ? std::format("{:.4f}", sum / n) : std::string{"."};
+    };
+    const auto tid = aln->core.tid;
+    const auto &targets = names[file_idx];
+    const auto chrom = tid >= 0 && tid < std::ssize(targets)
+                         ? std::string_view{targets[tid]}
+                         : std::string_view{"*"};
+    std::format_to(std::back_inserter(rows), "{}\t{}\t{}\t{}\t{}\t{}\t{}\t{}\n",
+                   bam_get_qname(aln), chrom, bam_is_rev(aln) ? '-' : '+',
+                   std::size(calls), mean(sum_m, n_m), mean(sum_h, n_h),
+                   n_m_above, n_h_above);
+  }
+};
+
+/* Decides when to stop reading before the end of the input. Workers add
+ * the m and h calls of each batch, and every interval reads the normalised
+ * m and h histograms are compared with the previous snapshot. Reading
+ * stops once the larger of the two distances (L1, or KS if ks is set)
+ * stays below tolerance for patience snapshots in a row, or once the time
+ * limit passes. Snapshots follow the order batches finish in.
+ */
+struct early_stop {
+  using hist = std::array<std::uint64_t, mod_prob_stats::n_values>;
+
+  enum class reason : std::uint8_t { end_of_input, converged, time_limit };
+
+  // calls from one batch
+  struct counts {
+    std::uint64_t n_reads{};
+    mod_prob_stats::call_quals quals;
+  };
+
+  std::uint64_t interval{};  // 0 to not check convergence
+  double tolerance{0.001};
+  std::uint32_t patience{3};
+  bool ks{};
+  std::optional<stage_times::time_point> deadline;
+
+  [[nodiscard]] auto
+  should_stop() -> bool {
+    if (stop)
+      return true;
+    if (deadline && stage_times::clock::now() >= *deadline) {
+      std::lock_guard lock{mtx};
+      set_reason(reason::time_limit);
+    }
+    return stop;
+  }
+
+  auto
+  add(const counts &c) -> void {
+    std::lock_guard lock{mtx};
+    auto &m = total.quals.m;
+    auto &h = total.quals.h;
+    std::ranges::transform(m, c.quals.m, std::begin(m), std::plus{});
+    std::ranges::transform(h, c.quals.h, std::begin(h), std::plus{});
+    total.n_reads += c.n_reads;
+    if (!interval || total.n_reads < last.n_reads + interval)
+      return;
+    last_distance = std::max(distance(last.quals.m, m),
+                             distance(last.quals.h, h));
+    n_stable = last_distance < tolerance ? n_stable + 1 : 0;
+    ++n_snapshots;
+    last = total;
+    if (n_stable >= patience)
+      set_reason(reason::converged);
+  }
+
+  [[nodiscard]] auto
+  to_json() const -> nlohmann::json {
+    static constexpr std::array<std::string_view, 3> names = {
+      "end_of_input", "converged", "time_limit"};
+    return {
+      // NOLINTNEXTLINE(*-constant-array-index)
+      {"reason", names[std::to_underlying(why)]},
+      {"snapshots", n_snapshots},
+      {"last_distance", last_distance},
+      {"reads_at_last_snapshot", last.n_reads},
+    };
+  }
+
+private:
+  std::atomic_bool stop{};
+  reason why{reason::end_of_input};
+  counts total;
+  counts last;  // at the last snapshot
+  std::uint32_t n_snapshots{};
+  std::uint32_t n_stable{};
+  double last_distance{std::numeric_limits<double>::infinity()};
+  std::mutex mtx;
+
+  auto
+  set_reason(const reason r) -> void {
+    if (!stop)
+      why = r;
+    stop = true;
+  }
+
+  [[nodiscard]] auto
+  distance(const hist &a, const hist &b) const -> double {
+    const auto n_a = std::reduce(std::cbegin(a), std::cend(a), 0.0);
+    const auto n_b = std::reduce(std::cbegin(b), std::cend(b), 0.0);
+    if (n_a == 0 || n_b == 0)
+      return std::numeric_limits<double>::infinity();
+    double d{};
+    double cdf{};
+    for (auto i = 0u; i < std::size(a); ++i) {
+      // NOLINTNEXTLINE(*-constant-array-index)
+      const auto diff = a[i] / n_a - b[i] / n_b;
+      cdf += diff;
+      d = ks ? std::max(d, std::abs(cdf)) : d + std::abs(diff);
+    }
+    return d;
+  }
+};
+
+/* Reader stage: takes empty batches from the pool, fills them and passes
+ * them on. Consumers return each batch to the pool once done with it. If
+ * given, each batch is written to passthrough before it is passed on.
+ * Batches are numbered from seq, which is shared by all inputs. Reading
+ * ends early, as if at the end of the input, once stop says so or failed
+ * is set by a consumer. For BGZF input, between_batches is called with the
+ * virtual offset of the next record before each batch is taken, while the
+ * reader holds no batch. Returns the last status from reading.
+ */
+[[nodiscard]] static auto
+read_batches(input_file &f, const std::size_t file_idx, batch_queue &pool,
+             batch_queue &filled, std::atomic_uint64_t &seq,
+             passthrough_file *passthrough = nullptr,
+             run_metrics *metrics = nullptr, early_stop *stop = nullptr,
+             const std::atomic_bool *failed = nullptr,
+             const std::function<void(std::int64_t)> &between_batches = {})
+  -> std::int32_t {
+  std::int32_t read_status{};
+  std::uint64_t offset{};
+  record_batch *batch{};
+  while (read_status > -1 && !(stop && stop->should_stop()) &&
+         !(failed && *failed)) {
+    if (between_batches && f.in->is_bgzf)
+      between_batches(bgzf_tell(f.in->fp.bgzf));
+    if (!pool.pop(batch))
+      break;
+    stage_times times;
+    auto t = metrics ? stage_times::clock::now() : stage_times::time_point{};
+    auto &n = batch->n_recs;
+    n = 0;
+    batch->file_idx = file_idx;
+    while (n < record_batch::capacity &&
+           (read_status = f.read1(batch->recs[n])) > -1)
+      ++n;
+    if (metrics)
+      times.lap(stage_times::read, t);
+    if (passthrough)
+      passthrough->write(batch->records());
+    if (metrics) {
+      if (passthrough)
+        times.lap(stage_times::write, t);
+      if (f.in->is_bgzf) {
+        const auto pos = static_cast<std::uint64_t>(
+          bgzf_tell(f.in->fp.bgzf) >> 16);  // compressed offset
+        if (pos > offset)  // queries may seek back
+          metrics->n_bytes += pos - offset;
+        offset = pos;
+      }
+      metrics->add(times);
+    }
+    if (n > 0) {
+      batch->seq = seq++;
+      filled.push(batch);
+    }
+    else
+      pool.push(batch);
+  }
+  return read_status;
+}
+
+// regions given on the command line, resolved for each input's header
+struct region_args {
+  std::vector<std::string> regions;
+  std::string bed_file;
+
+  [[nodiscard]] auto
+  empty() const -> bool {
+    return regions.empty() && bed_file.empty();
+  }
+};
+
+/* Reader threads take input files in turn and share one pool of batches
+ * with the workers, so all inputs are processed together. A passthrough
+ * file, if named, gets a copy of the one input. Each worker
+ * accumulates into its own copy of each slot of results, which has either
+ * one slot or one for each input, and these are summed into results at the
+ * end. The calls from each batch go to pu, which needs a single input,
+ * and rows for each read go to per_read, both in input order, so inputs
+ * are then read one at a time. With stop, reading may end early. With
+ * ckpt, reading starts from its offset, if set, and the tables are saved
+ * whenever a save is due, after waiting for every batch to come back to
+ * the pool. Returns false if reading any input failed.
+ */
+[[nodiscard]] static auto
+process_reads(const std::vector<std::string> &infiles, htsThreadPool &tp,
+              const cram_args &cram, const region_args &reg_args,
+              const reference *ref, const read_filter &filter,
+              const std::string &passthrough, const std::uint32_t n_workers,
+              std::vector<grouped_stats> &results, pileup *pu,
+              per_read_output *per_read, early_stop *stop,
+              checkpoint *ckpt, run_metrics *metrics) -> bool {
+  static constexpr auto batches_per_worker = 2u;
+  const auto n_files = std::size(infiles);
+  const auto n_slots = std::size(results);
+  const auto ordered = pu || per_read;
+  const auto n_readers =
+    ordered ? 1 : std::min<std::size_t>(n_files, n_workers);
+
+  const auto n_batches = batches_per_worker * n_workers + n_readers;
+  std::vector<record_batch> batches(n_batches);
+  batch_queue pool(n_batches);
+  batch_queue filled(n_batches);
+  for (auto &batch : batches)
+    pool.push(&batch);
+
+  // filled in by readers before any batch from that file is passed on
+  std::vector<region_set> file_regions(n_files);
+  std::vector<ref_targets> file_refs(n_files);
+  const auto use_regions = !reg_args.empty();
+
+  std::optional<ordered_sink<pileup::batch>> sink;
+  if (pu)
+    sink.emplace([pu](pileup::batch &b) { pu->add(b); });
+  std::optional<ordered_sink<std::string>> row_sink;
+  if (per_read) {
+    per_read->names.resize(n_files);
+    row_sink.emplace(
+      [per_read](std::string &rows) { per_read->out.write(rows); });
+  }
+
+  // a time limit alone is checked by the readers
+  const auto converge = stop && stop->interval > 0;
+  const auto timed = metrics && metrics->timed;
+
+  // workers keep returning batches after an error so readers can finish
+  thread_errors errors;
+  std::vector<std::vector<grouped_stats>> worker_stats(n_workers, results);
+  std::vector<std::jthread> workers;
+  for (auto &stats : worker_stats)
+    workers.emplace_back([&pool, &filled, &stats, &file_regions, use_regions,
+                          &file_refs, ref, &filter, n_slots, &sink, per_read,
+                          &row_sink, stop, converge, &errors, metrics,
+                          timed] {
+      stage_times times;
+      record_batch *batch{};
+      while (filled.pop(batch)) {
+        const auto i = batch->file_idx;
+        auto &slot = stats[n_slots == 1 ? 0 : i];
+        const auto regions = use_regions ? &file_regions[i] : nullptr;
+        const auto targets = ref ? &file_refs[i] : nullptr;
+        std::uint64_t n_reads{};
+        std::uint64_t n_bases{};
+        std::uint64_t n_calls{};
+        pileup::batch sites;
+        std::string rows;
+        early_stop::counts stop_counts;
+        try {
+          for (const auto aln : batch->records()) {
+            if (sink)
+              sites.starts.push_back(pileup::start_of(aln));
+            if (!filter(aln))
+              continue;
+            ++n_reads;
+            n_bases += aln->core.l_qseq;
+            const auto n_sites = std::size(sites.calls);
+            n_calls += slot(aln, regions, targets, timed ? &times : nullptr,
+                            sink || per_read ? &sites.calls : nullptr,
+                            converge ? &stop_counts.quals : nullptr);
+            if (per_read)
+              per_read->format(
+                aln, i, std::span{sites.calls}.subspan(n_sites), rows);
+            if (!sink)  // only the pileup needs calls past their read
+              sites.calls.clear();
+          }
+          if (sink)
+            sink->push(batch->seq, std::move(sites));
+          if (row_sink)
+            row_sink->push(batch->seq, std::move(rows));
+          if (converge) {
+            stop_counts.n_reads = n_reads;
+            stop->add(stop_counts);
+          }
+        }
+        catch (...) {
+          errors.capture();
+        }
+        pool.push(batch);
+        if (metrics) {
+          metrics->add(n_reads, n_bases, n_calls, times);
+          times = {};
+        }
+      }
+    });
+
+  // with every batch held here the workers are idle
+  const auto save = [&](const std::int64_t next) {
+    if (!ckpt->due())
+      return;
+    std::vector<record_batch *> held(n_batches);
+    for (auto &batch : held)
+      std::ignore = pool.pop(batch);
+    auto sums = results;
+    for (const auto &stats : worker_stats)
+      for (auto i = 0u; i < n_slots; ++i)
+        sums[i] += stats[i];
+    ckpt->save(make_summary(sums, infiles, ckpt->per_file), next);
+    for (const auto batch : held)
+      pool.push(batch);
+  };
+
+  std::atomic_size_t next_file{};
+  std::atomic_uint64_t next_seq{};
+  std::atomic_bool read_failed{};
+  std::vector<std::jthread> readers;
+  for (auto r = 0u; r < n_readers; ++r)
+    readers.emplace_back([&] {
+      try {
+        std::size_t i{};
+        while (!errors.failed && !(stop && stop->should_stop()) &&
+               (i = next_file++) < n_files) {
+          stage_times times;
+          auto t = stage_times::clock::now();
+          input_file f(infiles[i], tp, &cram);
+          if (ref)
+            file_refs[i] = ref_targets(*ref, f.hdr.get());
+          if (pu)
+            pu->set_targets(f.hdr.get());
+          if (per_read)
+            per_read->set_targets(i, f.hdr.get());
+          if (ckpt && !f.in->is_bgzf)
+            throw std::runtime_error("--checkpoint needs BGZF input: " +
+                                     infiles[i]);
+          if (ckpt && ckpt->offset >= 0 &&
+              bgzf_seek(f.in->fp.bgzf, ckpt->offset, SEEK_SET) < 0)
+            throw std::runtime_error("failed to resume reading: " +
+                                     infiles[i]);
+          if (use_regions) {
+            f.load_index();
+            file_regions[i] =
+              read_regions(f.hdr.get(), reg_args.regions, reg_args.bed_file);
+            if (!f.query(file_regions[i]))
+              continue;  // nothing to count in this file
+          }
+          if (metrics) {
+            times.lap(stage_times::open, t);
+            metrics->add(times);
+          }
+          std::optional<passthrough_file> pt;
+          if (!passthrough.empty())
+            pt.emplace(passthrough, f.hdr.get(), tp);
+          if (read_batches(f, i, pool, filled, next_seq,
+                           pt ? &*pt : nullptr, metrics, stop,
+                           &errors.failed,
+                           ckpt ? save : std::function<void(std::int64_t)>{}) <
+              -1) {  // -1 is EOF
+            std::println(std::cerr, "failed reading bam record: {}",
+                         infiles[i]);
+            read_failed = true;
+          }
+          if (pt)
+            pt->close();
+        }
+      }
+      catch (...) {
+        errors.capture();
+      }
+    });
+  readers.clear();  // joins
+  filled.close();
+  workers.clear();
+  errors.rethrow();
+
+  for (const auto &stats : worker_stats)
+    for (auto i = 0u; i < n_slots; ++i)
+      results[i] += stats[i];
+
+  return !read_failed;
+}
+
+/* Chunks tile each reference and a final chunk holds reads without
+ * coordinates. A read belongs to the chunk containing its start position,
+ * so reads spanning a boundary are counted once.
+ */
+[[nodiscard]] static auto
+get_genome_chunks(const sam_hdr_t *hdr, const hts_pos_t chunk_size)
+  -> std::vector<genome_chunk> {
+  std::vector<genome_chunk> chunks;
+  const auto n_refs = sam_hdr_nref(hdr);
+  for (std::int32_t tid = 0; tid < n_refs; ++tid) {
+    const auto ref_len = sam_hdr_tid2len(hdr, tid);
+    for (hts_pos_t beg = 0; beg < ref_len; beg += chunk_size)
+      chunks.emplace_back(tid, beg, std::min(beg + chunk_size, ref_len));
+  }
+  chunks.emplace_back(HTS_IDX_NOCOOR, 0, 0);
+  return chunks;
+}
+
+/* Chunks starting at n points spaced evenly along the references laid end
+ * to end. Each runs to the next point or the end of its reference, so a
+ * read is in at most one chunk.
+ */
+[[nodiscard]] static auto
+get_sample_chunks(const sam_hdr_t *hdr, const std::uint32_t n)
+  -> std::vector<genome_chunk> {
+  const auto n_refs = sam_hdr_nref(hdr);
+  hts_pos_t total{};
+  for (std::int32_t tid = 0; tid < n_refs; ++tid)
+    total += sam_hdr_tid2len(hdr, tid);
+  std::vector<genome_chunk> chunks;
+  std::int32_t tid{};
+  hts_pos_t offset{};  // of tid along all references
+  for (auto k = 0u; k < n; ++k) {
+    const auto point = static_cast<hts_pos_t>((k + 0.5) * total / n);
+    while (tid < n_refs && point >= offset + sam_hdr_tid2len(hdr, tid))
+      offset += sam_hdr_tid2len(hdr, tid++);
+    if (tid == n_refs)
+      break;
+    const auto beg = point - offset;
+    if (!chunks.empty() && chunks.back().tid == tid) {
+      if (chunks.back().beg == beg)
+        continue;
+      chunks.back().end = beg;
+    }
+    chunks.emplace_back(tid, beg, sam_hdr_tid2len(hdr, tid));
+  }
+  return chunks;
+}
+
+/* How process_regions splits each input: tiles of chunk_size covering
+ * the genome, or with n_samples set, that many evenly spaced chunks of at
+ * most reads_per_sample counted reads each.
+ */
+struct chunk_args {
+  hts_pos_t chunk_size{10'000'000};
+  std::uint32_t n_samples{};
+  std::uint64_t reads_per_sample{1000};
+
+  // counted reads in each chunk, 0 for no limit
+  [[nodiscard]] auto
+  max_reads() const -> std::uint64_t {
+    return n_samples ? reads_per_sample : 0;
+  }
+
+  [[nodiscard]] auto
+  chunks(const sam_hdr_t *hdr) const -> std::vector<genome_chunk> {
+    return n_samples ? get_sample_chunks(hdr, n_samples)
+                     : get_genome_chunks(hdr, chunk_size);
+  }
+};
+
+/* Chunks from every input are queued together. Each worker opens its own
+ * handle on the input of its current chunk, querying through the index
+ * loaded once for that input. A CRAM index is tied to the handle it was
+ * loaded with, so for CRAM each worker loads its own. Results has one
+ * slot or one per input as in process_reads. Returns false if any
+ * iterator reported an error.
+ */
+[[nodiscard]] static auto
+process_regions(const std::vector<std::string> &infiles, htsThreadPool &tp,
+                const cram_args &cram, const chunk_args &chunking,
+                const reference *ref, const read_filter &filter,
+                const std::uint32_t n_workers,
+                std::vector<grouped_stats> &results, run_metrics *metrics)
+  -> bool {
+  const auto n_slots = std::size(results);
+
+  std::vector<std::unique_ptr<hts_idx_t, void (*)(hts_idx_t *)>> indexes;
+  std::vector<std::pair<std::size_t, genome_chunk>> chunks;
+  std::vector<ref_targets> file_refs(std::size(infiles));
+  stage_times open_times;
+  auto t = stage_times::clock::now();
+  for (const auto &[i, infile] : std::views::enumerate(infiles)) {
+    input_file f(infile, tp, &cram);
+    f.load_index();
+    if (ref)
+      file_refs[i] = ref_targets(*ref, f.hdr.get());
+    for (const auto &chunk : chunking.chunks(f.hdr.get()))
+      chunks.emplace_back(i, chunk);
+    if (f.in->is_cram)
+      f.idx.reset();
+    indexes.push_back(std::move(f.idx));
+  }
+  if (metrics) {
+    open_times.lap(stage_times::open, t);
+    metrics->add(open_times);
+    metrics->total_chunks = std::size(chunks);
+  }
+
+  std::atomic_size_t next_chunk{};
+  std::atomic_bool read_failed{};
+  thread_errors errors;
+
+  std::vector<std::vector<grouped_stats>> worker_stats(n_workers, results);
+  std::vector<std::jthread> workers;
+  for (auto &stats : worker_stats)
+    workers.emplace_back([&infiles, &tp, &cram, &indexes, &chunks, &file_refs,
+                          ref, &filter, &next_chunk, &read_failed, &errors,
+                          &stats, n_slots, max_reads = chunking.max_reads(),
+                          metrics, timed = metrics && metrics->timed] {
+      try {
+        std::unique_ptr<bam1_t, void (*)(bam1_t *)> aln{bam_init1(),
+                                                        &bam_destroy1};
+        std::optional<input_file> f;
+        std::size_t file_idx{};
+        std::size_t i{};
+        while (!errors.failed && !read_failed &&
+               (i = next_chunk++) < std::size(chunks)) {
+          const auto &[chunk_file, chunk] = chunks[i];
+          const auto &[tid, beg, end] = chunk;
+          stage_times times;
+          auto t = stage_times::clock::now();
+          if (!f || file_idx != chunk_file) {
+            f.reset();
+            f.emplace(infiles[chunk_file], tp, &cram);
+            file_idx = chunk_file;
+            if (!indexes[chunk_file])
+              f->load_index();
+            if (metrics)
+              times.lap(stage_times::open, t);
+          }
+          auto &slot = stats[n_slots == 1 ? 0 : chunk_file];
+          const auto targets = ref ? &file_refs[chunk_file] : nullptr;
+          const auto idx =
+            indexes[chunk_file] ? indexes[chunk_file].get() : f->idx.get();
+          std::unique_ptr<hts_itr_t, void (*)(hts_itr_t *)> itr{
+            sam_itr_queryi(idx, tid, beg, end), &hts_itr_destroy};
+          if (!itr)
+            throw std::runtime_error("failed to query: " + f->filename);
+          std::uint64_t n_reads{};
+          std::uint64_t n_bases{};
+          std::uint64_t n_calls{};
+          std::int32_t read_status{};
+          while ((!max_reads || n_reads < max_reads) &&
+                 (read_status = sam_itr_next(f->in.get(), itr.get(),
+                                             aln.get())) > -1) {
+            if (timed)
+              times.lap(stage_times::read, t);
+            if ((tid == HTS_IDX_NOCOOR || aln->core.pos >= beg) &&
+                filter(aln.get())) {
+              ++n_reads;
+              n_bases += aln->core.l_qseq;
+              n_calls += slot(aln.get(), nullptr, targets,
+                              timed ? &times : nullptr);
+              if (timed)
+                t = stage_times::clock::now();
+            }
+          }
+          if (metrics) {
+            times.lap(stage_times::read, t);
+            metrics->add(n_reads, n_bases, n_calls, times);
+            ++metrics->n_chunks;
+          }
+          if (read_status < -1) {
+            std::println(std::cerr, "failed reading bam record: {}",
+                         f->filename);
+            read_failed = true;
+          }
+        }
+      }
+      catch (...) {
+        errors.capture();
+      }
+    });
+  workers.clear();  // joins
+  errors.rethrow();
+
+  for (const auto &stats : worker_stats)
+    for (auto i = 0u; i < n_slots; ++i)
+      results[i] += stats[i];
+
+  return !read_failed;
+}
+
+// defined when this file is included by the benchmarks
+#ifndef NANOPORE_MODS_NO_MAIN
+int
+main(int argc, char *argv[]) {  // NOLINT(*-c-arrays)
+  static constexpr std::chrono::seconds progress_interval{10};
+  std::string outfile;
+  std::string output_format{"json"};
+  std::vector<std::string> infiles;
+  std::string input_list;
+  region_args reg_args;
+  std::uint32_t n_threads{1};
+  read_filter filter;
+  std::string group_tag;
+  std::string passthrough;
+  std::string ref_file;
+  std::string pileup_file;
+  double pileup_threshold{};
+  bool pileup_cpg{};
+  std::string per_read_file;
+  double per_read_threshold{0.5};
+  early_stop stop;
+  double max_seconds{};
+  cram_args cram;
+  std::string checkpoint_file;
+  std::uint32_t checkpoint_every{600};
+  bool resume{};
+  std::string distance{"l1"};
+  std::uint32_t width{min_context_width};
+  bool progress{};
+  chunk_args chunking;
+  bool stranded{};
+  bool by_region{};
+  bool per_file{};
+
+  CLI::App app{};
+  argv = app.ensure_utf8(argv);
+  app.usage("Usage: nanopore-mods [options]\n"
+            "       nanopore-mods merge [options] inputs...");
+
+  // clang-format off
+  const auto input_opt =
+    app.add_option("-i,--input", infiles,
+                   "BAM/SAM input files, - for stdin (repeatable)")
+    ->check(CLI::ExistingFile | CLI::IsMember({"-"}));
+  const auto input_list_opt =
+    app.add_option("--input-list", input_list, "file listing inputs, one per line")
+    ->check(CLI::ExistingFile);
+  app.add_flag("--per-file", per_file, "output results for each input file");
+  app.add_option("--group-by", group_tag,
+                 "output results for each value of this aux tag (e.g. RG, HP)")
+    ->check([](const std::string &tag) {
+      return std::size(tag) == 2 ? "" : "tag must be two characters";
+    });
+  app.add_option("-o,--output", outfile, "output file");
+  app.add_option("--output-format", output_format, "json or binary")
+    ->check(CLI::IsMember({"json", "binary"}));
+  app.add_option("-t,--threads", n_threads, "threads for decompression and parsing")
+    ->check(CLI::PositiveNumber);
   app.add_flag("--stranded", stranded, "output strand-specific results");
+  app.add_flag("--progress", progress,
+               "report speed to stderr and add run_metrics to the output");
+  app.add_flag("--by-region", by_region,
+               "process genome chunks in parallel (requires index)");
+  app.add_option("--chunk-size", chunking.chunk_size,
+                 "genome chunk size for --by-region")
+    ->check(CLI::PositiveNumber);
+  const auto quick_opt =
+    app.add_option("--quick", chunking.n_samples,
+                   "count reads at this many evenly spaced places (requires index)")
+    ->check(CLI::PositiveNumber);
+  app.add_option("--quick-reads", chunking.reads_per_sample,
+                 "reads counted at each place for --quick")
+    ->check(CLI::PositiveNumber);
+  const auto region_opt =
+    app.add_option("--region", reg_args.regions,
+                   "only count positions in region chr:start-end (repeatable)");
+  const auto bed_opt = app.add_option("--bed", reg_args.bed_file,
+                                      "only count positions in these intervals")
+    ->check(CLI::ExistingFile);
+  app.add_option("--context", width,
+                 "context width: the modified base and the bases after it")
+    ->check(CLI::Range(min_context_width, max_context_width));
+  app.add_option("--reference", ref_file,
+                 "take contexts from this FASTA instead of the reads")
+    ->check(CLI::ExistingFile);
+  app.add_option("--cram-reference", cram.reference,
+                 "FASTA for decoding CRAM (default: --reference, then REF_PATH)")
+    ->check(CLI::ExistingFile);
+  app.add_option("--min-mapq", filter.min_mapq, "minimum mapping quality")
+    ->check(CLI::Range(0, 255));
+  app.add_option("--exclude-flags", filter.exclude_flags,
+                 std::format("skip reads with any of these flags (default: {:#x})",
+                             read_filter::default_exclude_flags));
+  app.add_option("--min-read-length", filter.min_read_length,
+                 "minimum read length")
+    ->check(CLI::NonNegativeNumber);
+  app.add_option("--fraction", filter.fraction,
+                 "count this fraction of reads, chosen by a hash of the read name")
+    ->check(CLI::Range(0.0, 1.0));
+  app.add_option("--seed", filter.seed, "seed for choosing reads with --fraction");
+  const auto passthrough_opt =
+    app.add_option("--passthrough", passthrough,
+                   "copy every input record to this file, - for stdout");
+  const auto pileup_opt =
+    app.add_option("--pileup", pileup_file,
+                   "write per-site C+h/C+m counts as bedMethyl (.gz to compress);"
+                   " input must be coordinate-sorted");
+  app.add_option("--pileup-threshold", pileup_threshold,
+                 "calls below this probability count as failed in --pileup")
+    ->check(CLI::Range(0.0, 1.0));
+  app.add_flag("--pileup-cpg", pileup_cpg, "only CpG sites in --pileup");
+  const auto per_read_opt =
+    app.add_option("--per-read", per_read_file,
+                   "write C+h/C+m summaries for each read as TSV (.gz to compress)");
+  app.add_option("--per-read-threshold", per_read_threshold,
+                 "probability counted as modified in --per-read")
+    ->check(CLI::Range(0.0, 1.0));
+  app.get_option("--by-region")->excludes(region_opt)->excludes(bed_opt);
+  passthrough_opt->excludes("--by-region")->excludes(region_opt)->excludes(bed_opt);
+  pileup_opt->excludes("--by-region");
+  per_read_opt->excludes("--by-region");
+  const auto converge_opt =
+    app.add_option("--converge-every", stop.interval,
+                   "stop once histograms are stable between snapshots this many reads apart")
+    ->check(CLI::PositiveNumber);
+  app.add_option("--converge-tolerance", stop.tolerance,
+                 "largest distance between snapshots counted as stable")
+    ->check(CLI::NonNegativeNumber);
+  app.add_option("--converge-count", stop.patience,
+                 "stable snapshots in a row needed to stop")
+    ->check(CLI::PositiveNumber);
+  app.add_option("--converge-distance", distance, "l1 or ks")
+    ->check(CLI::IsMember({"l1", "ks"}));
+  const auto max_seconds_opt =
+    app.add_option("--max-seconds", max_seconds, "stop reading after this long")
+    ->check(CLI::PositiveNumber);
+  for (const auto opt : {converge_opt, max_seconds_opt})
+    opt->excludes("--by-region")->excludes(passthrough_opt);
+  quick_opt->excludes(converge_opt)->excludes(max_seconds_opt);
+  const auto checkpoint_opt =
+    app.add_option("--checkpoint", checkpoint_file,
+                   "save progress to this file to resume from (one BAM input)");
+  app.add_option("--checkpoint-every", checkpoint_every,
+                 "seconds between checkpoint saves")
+    ->check(CLI::PositiveNumber);
+  app.add_flag("--resume", resume, "carry on from the --checkpoint file if it exists")
+    ->needs(checkpoint_opt);
+  checkpoint_opt->excludes("--by-region")->excludes(quick_opt)
+    ->excludes(region_opt)->excludes(bed_opt)->excludes(passthrough_opt)
+    ->excludes(pileup_opt)->excludes(per_read_opt);
+  quick_opt->excludes("--by-region")->excludes(region_opt)->excludes(bed_opt)
+    ->excludes(passthrough_opt)->excludes(pileup_opt)->excludes(per_read_opt);
+
+  std::vector<std::string> merge_infiles;
+  const auto merge_cmd =
+    app.add_subcommand("merge", "sum JSON or binary summaries from earlier runs");
+  merge_cmd->add_option("inputs", merge_infiles, "summary files")
+    ->required()
+    ->check(CLI::ExistingFile);
+  merge_cmd->add_option("-o,--output", outfile, "output file")
+    ->required();
+  merge_cmd->add_option("--output-format", output_format, "json or binary")
+    ->check(CLI::IsMember({"json", "binary"}));
+  merge_cmd->add_option("-t,--threads", n_threads, "threads for reading inputs")
+    ->check(CLI::PositiveNumber);
+  merge_cmd->add_flag("--stranded", stranded, "output strand-specific results");
   // clang-format on
 
   if (argc < 2) {
     std::println("{}", app.help());
     return EXIT_SUCCESS;
   }
-  CLI11_PARSE(app, argc, argv);
+  try {
+    app.parse(argc, argv);
+    // required unless a subcommand is used
+    if (!merge_cmd->parsed() && input_opt->empty() && input_list_opt->empty())
+      throw CLI::RequiredError("--input");
+    if (!merge_cmd->parsed() && outfile.empty())
+      throw CLI::RequiredError("--output");
+  }
+  catch (const CLI::ParseError &e) {
+    return app.exit(e);
+  }
 
-  auto in = hts_open(infile.data(), "r");
-  if (!in)
-    throw std::runtime_error("failed to open file: " + infile);
-  std::unique_ptr<sam_hdr_t, void (*)(sam_hdr_t *)> hdr{sam_hdr_read(in),
-                                                        &bam_hdr_destroy};
-  if (!hdr)
-    throw std::runtime_error("failed to parse header from file: " + infile);
+  if (merge_cmd->parsed()) {
+    const auto need_stranded = stranded || output_format == "binary";
+    const auto s = merge_summaries(merge_infiles, n_threads, need_stranded);
+    write_output(outfile, output_format, stranded, s);
+    return EXIT_SUCCESS;
+  }
 
-  std::unique_ptr<bam1_t, void (*)(bam1_t *)> aln{bam_init1(), &bam_destroy1};
+  if (!input_list.empty()) {
+    std::ifstream in(input_list);
+    if (!in)
+      throw std::runtime_error("failed to open file: " + input_list);
+    std::string line;
+    while (std::getline(in, line))
+      if (!line.empty())
+        infiles.push_back(line);
+  }
 
-  mod_prob_stats mps;
+  if (!passthrough.empty() && std::size(infiles) != 1)
+    throw std::runtime_error("--passthrough requires a single input");
+  if (!pileup_file.empty() && std::size(infiles) != 1)
+    throw std::runtime_error("--pileup requires a single input");
+  if (!checkpoint_file.empty() &&
+      (std::size(infiles) != 1 || infiles.front() == "-"))
+    throw std::runtime_error("--checkpoint requires a single input file");
 
-  std::int32_t read_status{};
-  while ((read_status = sam_read1(in, hdr.get(), aln.get())) > -1)
-    mps(aln.get());
+  // CRAM decodes only what counting and the enabled options read
+  if (cram.reference.empty())
+    cram.reference = ref_file;
+  const auto quick = chunking.n_samples > 0;
+  if (passthrough.empty()) {
+    cram.required_fields = SAM_FLAG | SAM_SEQ | SAM_AUX | SAM_RGAUX;
+    if (!ref_file.empty() || !reg_args.empty() || by_region || quick ||
+        !pileup_file.empty() || !per_read_file.empty())
+      cram.required_fields |= SAM_RNAME | SAM_POS | SAM_CIGAR;
+    if (filter.min_mapq > 0)
+      cram.required_fields |= SAM_MAPQ;
+    if (filter.fraction < 1.0 || !per_read_file.empty())
+      cram.required_fields |= SAM_QNAME;
+  }
 
-  hts_close(in);
+  // the pool is shared by all open inputs and outputs other than -o
+  htsThreadPool tp{};
+  if (n_threads > 1) {
+    tp.pool = hts_tpool_init(static_cast<int>(n_threads));
+    if (!tp.pool)
+      throw std::runtime_error("failed to create thread pool");
+  }
 
-  if (read_status < -1) {  // -1 is EOF
-    std::println(std::cerr, "failed reading bam record");
-    return EXIT_FAILURE;
+  std::optional<reference> ref;
+  if (!ref_file.empty())
+    ref.emplace(ref_file);
+
+  std::optional<pileup> pu;
+  if (!pileup_file.empty())
+    pu.emplace(pileup_file, tp, pileup_threshold, pileup_cpg);
+  std::optional<per_read_output> per_read;
+  if (!per_read_file.empty())
+    per_read.emplace(per_read_file, tp, per_read_threshold);
+
+  std::optional<checkpoint> ckpt;
+  if (!checkpoint_file.empty()) {
+    ckpt.emplace(checkpoint_file, infiles.front(), group_tag, per_file, width,
+                 filter, ref_file, std::chrono::seconds{checkpoint_every});
+    if (resume && ckpt->load())
+      std::println(std::cerr, "resuming from: {}", checkpoint_file);
   }
 
-  std::ofstream out(outfile);
-  if (!out)
-    throw std::runtime_error("Error opening output file: " + outfile);
+  const auto early = stop.interval > 0 || max_seconds > 0;
+  stop.ks = distance == "ks";
+  if (max_seconds > 0)
+    stop.deadline = stage_times::clock::now() +
+                    std::chrono::duration_cast<stage_times::clock::duration>(
+                      std::chrono::duration<double>{max_seconds});
 
-  if (stranded)
-    std::println(out, "{}",
-                 nlohmann::json(mod_prob_stats_fmt_stranded(mps)).dump(4));
-  else
-    std::println(out, "{}", nlohmann::json(mod_prob_stats_fmt(mps)).dump(4));
+  // the sampling block gives the reads and bases a sample covers
+  const auto sampled = quick || filter.fraction < 1.0;
+  std::optional<run_metrics> metrics;
+  std::jthread reporter;
+  if (progress || sampled) {
+    metrics.emplace();
+    metrics->timed = progress;
+  }
+  if (progress) {
+    for (const auto &infile : infiles)
+      if (infile != "-")
+        metrics->total_bytes += std::filesystem::file_size(infile);
+    reporter = std::jthread([&metrics](const std::stop_token stop) {
+      metrics->report_every(stop, progress_interval);
+    });
+  }
+
+  std::vector<grouped_stats> results(per_file ? std::size(infiles) : 1,
+                                     grouped_stats{group_tag, width});
+  const auto read_ok =
+    by_region || quick
+      ? process_regions(infiles, tp, cram, chunking, ref ? &*ref : nullptr,
+                        filter, n_threads, results,
+                        metrics ? &*metrics : nullptr)
+      : process_reads(infiles, tp, cram, reg_args, ref ? &*ref : nullptr,
+                      filter, passthrough, n_threads, results,
+                      pu ? &*pu : nullptr,
+                      per_read ? &*per_read : nullptr,
+                      early ? &stop : nullptr, ckpt ? &*ckpt : nullptr,
+                      metrics ? &*metrics : nullptr);
+  reporter = {};  // stops and joins
+  if (progress)
+    metrics->report(std::cerr);
+  if (pu)
+    pu->finish();
+  if (per_read)
+    per_read->out.close();
+
+  if (tp.pool)
+    hts_tpool_destroy(tp.pool);
+
+  if (!read_ok)
+    return EXIT_FAILURE;
+
+  auto s = make_summary(results, infiles, per_file);
+  if (ckpt)
+    s += ckpt->restored;
+
+  auto info = nlohmann::json::object();
+  if (sampled) {
+    auto &x = info["sampling"];
+    if (quick) {
+      x["chunks"] = metrics->total_chunks.load();
+      x["reads_per_chunk"] = chunking.reads_per_sample;
+    }
+    if (filter.fraction < 1.0) {
+      x["fraction"] = filter.fraction;
+      x["seed"] = filter.seed;
+    }
+    x["reads"] = metrics->n_reads.load();
+    x["bases"] = metrics->n_bases.load();
+    x["calls"] = metrics->n_calls.load();
+  }
+  if (early)
+    info["early_stop"] = stop.to_json();
+
+  write_output(outfile, output_format, stranded, s,
+               progress ? &*metrics : nullptr, info);
+  if (ckpt)
+    ckpt->remove();  // the output now has everything
 
   return EXIT_SUCCESS;
 }
+#endif
@@ -0,0 +1,471 @@
+/* MIT License
+ *
+ * Copyright (c) 2025 Andrew D Smith
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/* Benchmarks for nanopore-mods on synthetic reads. The generator is
+ * deterministic for a given seed, so two builds run with the same options
+ * see exactly the same input and can be compared directly.
+ */
+
+#define NANOPORE_MODS_NO_MAIN
+#include "nanopore_mods.cpp"
+
+#include <random>
+
+// shape of the synthetic reads
+struct synth_params {
+  std::uint64_t seed{1};
+  std::uint32_t n_reads{100'000};
+  std::uint32_t min_len{1'000};
+  std::uint32_t max_len{20'000};
+  double mod_density{0.5};      // fraction of candidate bases with calls
+  double hm_fraction{0.9};      // reads with C+h and C+m, others only C+m
+  double joint_fraction{0.5};   // of those, C+hm in one MM entry
+  double other_fraction{0.1};   // reads that also have A+a calls
+  double duplex_fraction{0.1};  // reads that also have G-m calls
+  double chebi_fraction{0.1};   // reads that also have C+76792 calls
+  double rev_fraction{0.5};
+  double unaligned_fraction{};
+  hts_pos_t ref_len{100'000'000};
+};
+
+/* Reads are drawn in the orientation they were sequenced and MM deltas
+ * counted along that, then reverse reads are stored reverse complemented
+ * as they would be in a BAM file. Only the 64-bit Mersenne twister is used
+ * since its output, unlike the standard distributions, is the same for
+ * every standard library. Reads come out in coordinate order, aligned ones
+ * at increasing positions and then the unaligned ones, so the BAM written
+ * from them can be indexed.
+ */
+struct synth_reads {
+  explicit synth_reads(const synth_params &p) :
+    p{p}, rng{p.seed},
+    n_aligned{p.n_reads - static_cast<std::uint32_t>(std::llround(
+                            p.unaligned_fraction * p.n_reads))},
+    max_step{std::max<std::uint64_t>(
+      2 * (p.ref_len - p.max_len) / std::max(n_aligned, 1u), 1)} {}
+
+  auto
+  next(bam1_t *aln) -> void {
+    const auto len = p.min_len + uniform(p.max_len - p.min_len + 1);
+    read.resize(len);
+    for (auto &b : read)
+      b = "ACGT"[rng() & 3u];  // NOLINT(*-constant-array-index)
+
+    mm.clear();
+    ml.clear();
+    if (chance(p.hm_fraction))
+      add_calls("C+", {"h", "m"}, chance(p.joint_fraction));
+    else
+      add_calls("C+", {"m"});
+    if (chance(p.other_fraction))
+      add_calls("A+", {"a"});
+    if (chance(p.duplex_fraction))
+      add_calls("G-", {"m"});
+    if (chance(p.chebi_fraction))
+      add_calls("C+", {"76792"});
+
+    const auto rev = chance(p.rev_fraction);
+    const auto unaligned = n_made >= n_aligned;
+    std::uint16_t flag = rev ? BAM_FREVERSE : 0;
+    if (rev) {
+      std::ranges::reverse(read);
+      std::ranges::transform(read, std::begin(read), [](const char b) {
+        return b == 'A' ? 'T' : b == 'C' ? 'G' : b == 'G' ? 'C' : 'A';
+      });
+    }
+    std::int32_t tid{};
+    hts_pos_t pos{};
+    std::uint32_t cigar = len << BAM_CIGAR_SHIFT | BAM_CMATCH;
+    if (unaligned) {
+      flag |= BAM_FUNMAP;
+      tid = -1;
+      pos = -1;
+    }
+    else {
+      last_pos = std::min(last_pos + static_cast<hts_pos_t>(uniform(max_step)),
+                          p.ref_len - p.max_len);
+      pos = last_pos;
+    }
+
+    const auto name = std::format("read{}", n_made++);
+    if (bam_set1(aln, std::size(name), name.data(), flag, tid, pos,
+                 unaligned ? 0 : 60, unaligned ? 0 : 1, &cigar, -1, -1, 0,
+                 len, read.data(), nullptr,
+                 std::size(mm) + std::size(ml) + 16) < 0 ||
+        bam_aux_append(aln, "MM", 'Z', static_cast<int>(std::size(mm) + 1),
+                       // NOLINTNEXTLINE(*-reinterpret-cast)
+                       reinterpret_cast<const std::uint8_t *>(mm.c_str())) <
+          0 ||
+        bam_aux_update_array(aln, "ML", 'C', std::size(ml), ml.data()) < 0)
+      throw std::runtime_error("failed to build synthetic record");
+  }
+
+private:
+  synth_params p;
+  std::mt19937_64 rng;
+  std::uint32_t n_aligned{};
+  std::uint64_t max_step{};
+  std::uint64_t n_made{};
+  hts_pos_t last_pos{};
+  std::string read;
+  std::string mm;
+  std::vector<std::uint8_t> ml;
+  std::vector<std::uint32_t> deltas;
+
+  [[nodiscard]] auto
+  uniform(const std::uint64_t n) -> std::uint64_t {
+    return rng() % n;
+  }
+
+  [[nodiscard]] auto
+  chance(const double x) -> bool {
+    return static_cast<double>(rng() >> 11) * 0x1.0p-53 < x;
+  }
+
+  /* Calls for each code share positions, with probabilities for each.
+   * Joint codes go in one MM entry with their ML values interleaved, and
+   * each entry is marked '?' or '.' at random. The MM letter is counted
+   * on the original read for either strand.
+   */
+  auto
+  add_calls(const std::string_view base_strand,
+            const std::initializer_list<std::string_view> codes,
+            const bool joint = false) -> void {
+    deltas.clear();
+    std::uint32_t skipped{};
+    for (const auto b : read) {
+      if (b != base_strand.front())
+        continue;
+      if (chance(p.mod_density)) {
+        deltas.push_back(skipped);
+        skipped = 0;
+      }
+      else
+        ++skipped;
+    }
+    const auto add_entry = [&](const auto &entry_codes) {
+      mm += base_strand;
+      for (const auto code : entry_codes)
+        mm += code;
+      mm += chance(0.5) ? '?' : '.';
+      for (const auto d : deltas) {
+        mm += std::format(",{}", d);
+        for (auto i = 0u; i < std::size(entry_codes); ++i)
+          ml.push_back(static_cast<std::uint8_t>(rng()));
+      }
+      mm += ';';
+    };
+    if (joint)
+      add_entry(codes);
+    else
+      for (const auto code : codes)
+        add_entry(std::array{code});
+  }
+};
+
+[[nodiscard]] static auto
+elapsed_since(const stage_times::time_point t) -> double {
+  return std::chrono::duration<double>(stage_times::clock::now() - t).count();
+}
+
+/* basemod_parser replaces bam_parse_basemod and bam_next_basemod, so the
+ * calls it finds in each read must be exactly those htslib reports: the
+ * same SEQ positions, codes, strands and ML values.
+ */
+static auto
+check_parser(const synth_params &p) -> void {
+  using call = std::tuple<std::int32_t, int, int, int>;
+  std::unique_ptr<bam1_t, void (*)(bam1_t *)> aln{bam_init1(), &bam_destroy1};
+  std::unique_ptr<hts_base_mod_state, void (*)(hts_base_mod_state *)> state{
+    hts_base_mod_state_alloc(), &hts_base_mod_state_free};
+  if (!state)
+    throw std::runtime_error("failed to allocate base modification state");
+  basemod_parser parser;
+  synth_reads gen(p);
+  std::vector<call> ours;
+  std::vector<call> theirs;
+  std::array<hts_base_mod, 16> mods{};
+  std::uint64_t n_calls{};
+  for (auto i = 0u; i < p.n_reads; ++i) {
+    gen.next(aln.get());
+    const std::string name = bam_get_qname(aln.get());
+    const auto parsed = parser.parse(aln.get());
+    if (parsed != (bam_parse_basemod(aln.get(), state.get()) == 0))
+      throw std::runtime_error("parser and htslib disagree on parsing " +
+                               name);
+    if (!parsed)
+      continue;
+
+    ours.clear();
+    for (const auto &e : parser.entries)
+      for (auto j = 0u; j < e.n_codes; ++j) {
+        const auto t = parser.track(e, j);
+        for (auto k = 0u; k < t.size(); ++k)
+          ours.emplace_back(t.pos(k), parser.codes[e.code_beg + j], e.minus,
+                            t.qual(k));
+      }
+
+    theirs.clear();
+    int pos{};
+    int n{};
+    while ((n = bam_next_basemod(aln.get(), state.get(), mods.data(),
+                                 static_cast<int>(std::size(mods)), &pos)) >
+           0) {
+      const auto n_mods = static_cast<std::size_t>(n);
+      if (n_mods > std::size(mods))
+        throw std::runtime_error("too many modifications at one base: " +
+                                 name);
+      for (const auto &m : std::span{mods}.first(n_mods))
+        theirs.emplace_back(pos, m.modified_base, m.strand, m.qual);
+    }
+    if (n < 0)
+      throw std::runtime_error("htslib failed to read calls: " + name);
+
+    std::ranges::sort(ours);
+    std::ranges::sort(theirs);
+    if (const auto [a, b] = std::ranges::mismatch(ours, theirs);
+        a != std::end(ours) || b != std::end(theirs))
+      throw std::runtime_error(std::format(
+        "parser differs from htslib on {} at SEQ position {}", name,
+        std::get<0>(a != std::end(ours) ? *a : *b)));
+    n_calls += std::size(ours);
+  }
+  std::println("parser: {} reads, {} calls, same as htslib", p.n_reads,
+               n_calls);
+}
+
+// in-memory records, counted repeatedly by mod_prob_stats::operator()
+static auto
+bench_count(const synth_params &p, const std::uint32_t width,
+            const std::uint32_t iterations) -> mod_prob_stats {
+  std::vector<std::unique_ptr<bam1_t, void (*)(bam1_t *)>> recs;
+  synth_reads gen(p);
+  std::uint64_t n_bases{};
+  for (auto i = 0u; i < p.n_reads; ++i) {
+    recs.emplace_back(bam_init1(), &bam_destroy1);
+    gen.next(recs.back().get());
+    n_bases += recs.back()->core.l_qseq;
+  }
+
+  mod_prob_stats mps(width);
+  std::uint64_t n_calls{};
+  const auto t = stage_times::clock::now();
+  for (auto i = 0u; i < iterations; ++i)
+    for (const auto &aln : recs)
+      n_calls += mps(aln.get());
+  const auto secs = elapsed_since(t);
+  const auto n = static_cast<double>(iterations);
+  std::println("count: {:.0f} reads/s, {:.3g} bases/s, {:.3g} calls/s",
+               n * std::size(recs) / secs, n * n_bases / secs,
+               static_cast<double>(n_calls) / secs);
+  return mps;
+}
+
+// time per call of each way a table set is written out
+static auto
+bench_format(const mod_prob_stats &mps, const std::uint32_t iterations)
+  -> void {
+  const auto per_call = [iterations](const auto &f) {
+    std::size_t n_bytes{};
+    const auto t = stage_times::clock::now();
+    for (auto i = 0u; i < iterations; ++i)
+      n_bytes += f();
+    const auto ms = 1000.0 * elapsed_since(t) / iterations;
+    return std::format("{:.3f} ms/call, {} bytes", ms, n_bytes / iterations);
+  };
+  std::println("format json: {}", per_call([&] {
+                 return nlohmann::json(mod_prob_stats_fmt(mps)).dump(4).size();
+               }));
+  std::println("format json stranded: {}", per_call([&] {
+                 return nlohmann::json(mod_prob_stats_fmt_stranded(mps))
+                   .dump(4)
+                   .size();
+               }));
+  summary s;
+  s.sections.try_emplace({}, mps.width).first->second += mps;
+  std::println("format binary: {}", per_call([&] {
+                 std::ostringstream out;
+                 write_binary(out, s);
+                 return out.view().size();
+               }));
+}
+
+static auto
+write_synthetic_bam(const synth_params &p, const std::string &filename,
+                    const std::uint32_t n_threads) -> void {
+  std::unique_ptr<sam_hdr_t, void (*)(sam_hdr_t *)> hdr{sam_hdr_init(),
+                                                        &sam_hdr_destroy};
+  const auto ref_len = std::to_string(p.ref_len);
+  if (!hdr ||
+      sam_hdr_add_line(hdr.get(), "HD", "VN", "1.6", "SO",
+                       "coordinate", nullptr) < 0 ||
+      sam_hdr_add_line(hdr.get(), "SQ", "SN", "chr1", "LN", ref_len.data(),
+                       nullptr) < 0)
+    throw std::runtime_error("failed to build synthetic header");
+
+  htsThreadPool tp{};
+  if (n_threads > 1)
+    tp.pool = hts_tpool_init(static_cast<int>(n_threads));
+  {
+    passthrough_file out(filename, hdr.get(), tp);
+    std::unique_ptr<bam1_t, void (*)(bam1_t *)> aln{bam_init1(),
+                                                    &bam_destroy1};
+    synth_reads gen(p);
+    for (auto i = 0u; i < p.n_reads; ++i) {
+      gen.next(aln.get());
+      const auto rec = aln.get();
+      out.write(std::span{&rec, 1});
+    }
+    out.close();
+  }
+  if (tp.pool)
+    hts_tpool_destroy(tp.pool);
+}
+
+// whole runs on a BAM file, streaming and then by region if indexed
+static auto
+bench_end_to_end(const std::string &filename, const std::uint32_t width,
+                 const std::vector<std::uint32_t> &thread_counts,
+                 const bool by_region) -> void {
+  const std::vector<std::string> infiles{filename};
+  const auto mb =
+    static_cast<double>(std::filesystem::file_size(filename)) / (1 << 20);
+  for (const auto n_threads : thread_counts) {
+    htsThreadPool tp{};
+    if (n_threads > 1)
+      tp.pool = hts_tpool_init(static_cast<int>(n_threads));
+    std::vector<grouped_stats> results(1, grouped_stats{"", width});
+    run_metrics metrics;
+    const auto ok =
+      by_region ? process_regions(infiles, tp, cram_args{}, chunk_args{},
+                                  nullptr, read_filter{}, n_threads, results,
+                                  &metrics)
+                : process_reads(infiles, tp, cram_args{}, region_args{},
+                                nullptr, read_filter{}, "", n_threads, results,
+                                nullptr, nullptr, nullptr, nullptr, &metrics);
+    const auto secs = elapsed_since(metrics.start);
+    if (tp.pool)
+      hts_tpool_destroy(tp.pool);
+    if (!ok)
+      throw std::runtime_error("failed reading: " + filename);
+    std::println("{} threads={}: {:.2f}s, {:.0f} reads/s, {:.1f} MB/s",
+                 by_region ? "by-region" : "stream", n_threads, secs,
+                 static_cast<double>(metrics.n_reads) / secs, mb / secs);
+  }
+}
+
+int
+main(int argc, char *argv[]) {  // NOLINT(*-c-arrays)
+  synth_params p;
+  std::uint32_t count_reads{10'000};
+  std::uint32_t iterations{5};
+  std::vector<std::uint32_t> thread_counts{1, 2, 4, 8};
+  std::vector<std::string> benchmarks{"parser", "count", "format",
+                                      "end-to-end"};
+  std::string bam_file;
+  std::uint32_t width{min_context_width};
+
+  CLI::App app{"Benchmarks for nanopore-mods on synthetic reads"};
+  argv = app.ensure_utf8(argv);
+  // clang-format off
+  app.add_option("--seed", p.seed, "generator seed");
+  app.add_option("--reads", p.n_reads, "reads in the end-to-end BAM");
+  app.add_option("--count-reads", count_reads, "reads for parser, count and format")
+    ->check(CLI::PositiveNumber);
+  app.add_option("--iterations", iterations, "passes over the in-memory reads")
+    ->check(CLI::PositiveNumber);
+  app.add_option("--min-length", p.min_len, "minimum read length")
+    ->check(CLI::PositiveNumber);
+  app.add_option("--max-length", p.max_len, "maximum read length")
+    ->check(CLI::PositiveNumber);
+  app.add_option("--mod-density", p.mod_density, "fraction of bases with calls")
+    ->check(CLI::Range(0.0, 1.0));
+  app.add_option("--hm-fraction", p.hm_fraction, "fraction of reads with C+h and C+m")
+    ->check(CLI::Range(0.0, 1.0));
+  app.add_option("--joint-fraction", p.joint_fraction,
+                 "fraction of C+h and C+m reads with one C+hm entry")
+    ->check(CLI::Range(0.0, 1.0));
+  app.add_option("--other-fraction", p.other_fraction, "fraction of reads with A+a")
+    ->check(CLI::Range(0.0, 1.0));
+  app.add_option("--duplex-fraction", p.duplex_fraction, "fraction of reads with G-m")
+    ->check(CLI::Range(0.0, 1.0));
+  app.add_option("--chebi-fraction", p.chebi_fraction, "fraction of reads with C+76792")
+    ->check(CLI::Range(0.0, 1.0));
+  app.add_option("--rev-fraction", p.rev_fraction, "fraction of reverse reads")
+    ->check(CLI::Range(0.0, 1.0));
+  app.add_option("--unaligned-fraction", p.unaligned_fraction,
+                 "fraction of unaligned reads")
+    ->check(CLI::Range(0.0, 1.0));
+  app.add_option("--threads", thread_counts, "thread counts for end-to-end runs")
+    ->delimiter(',')
+    ->check(CLI::PositiveNumber);
+  app.add_option("--benchmarks", benchmarks,
+                 "which of parser (check against htslib), count, format, end-to-end")
+    ->delimiter(',')
+    ->check(CLI::IsMember({"parser", "count", "format", "end-to-end"}));
+  app.add_option("--bam", bam_file, "write the end-to-end BAM here and keep it");
+  app.add_option("--context", width, "context width")
+    ->check(CLI::Range(min_context_width, max_context_width));
+  // clang-format on
+  CLI11_PARSE(app, argc, argv);
+
+  if (p.min_len > p.max_len)
+    throw std::runtime_error("--min-length exceeds --max-length");
+  if (p.max_len >= p.ref_len)
+    throw std::runtime_error("--max-length exceeds the reference length");
+  const auto enabled = [&](const std::string_view name) {
+    return std::ranges::find(benchmarks, name) != std::end(benchmarks);
+  };
+
+  auto count_params = p;
+  count_params.n_reads = count_reads;
+  if (enabled("parser"))
+    check_parser(count_params);
+  if (enabled("count") || enabled("format")) {
+    const auto mps = bench_count(count_params, width, iterations);
+    if (enabled("format"))
+      bench_format(mps, iterations);
+  }
+
+  if (enabled("end-to-end")) {
+    const auto keep = !bam_file.empty();
+    if (!keep)
+      bam_file =
+        (std::filesystem::temp_directory_path() / "nanopore_mods_bench.bam")
+          .string();
+    const auto t = stage_times::clock::now();
+    write_synthetic_bam(p, bam_file, thread_counts.back());
+    std::println("wrote {} reads to {} in {:.2f}s", p.n_reads, bam_file,
+                 elapsed_since(t));
+    bench_end_to_end(bam_file, width, thread_counts, false);
+    if (sam_index_build(bam_file.data(), 0) < 0)
+      throw std::runtime_error("failed to index: " + bam_file);
+    bench_end_to_end(bam_file, width, thread_counts, true);
+    if (!keep) {
+      std::filesystem::remove(bam_file);
+      std::filesystem::remove(bam_file + ".bai");
+    }
+  }
+
+  return EXIT_SUCCESS;
+}